@@ -0,0 +1,440 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../fork_tree.h"
+
+#define MAX_SIZES 16
+#define DEFAULT_REPETITIONS 5
+
+// Shapes of the benchmarked trees
+#define SHAPE_FANOUT 0
+#define SHAPE_CHAIN 1
+#define SHAPE_BINARY 2
+#define SHAPE_RANDOM 3
+#define NUMBER_OF_SHAPES 4
+
+const char *SHAPE_NAMES[NUMBER_OF_SHAPES] = {"fanout", "chain", "binary", "random"};
+
+// Renders measured on each tree, the timeline is rendered by its own function
+#define RENDER_TIMELINE -1
+#define RENDER_EXPORT -2
+
+typedef struct BenchRender {
+    const char *name;
+    int layout;
+    int flags;
+} bench_render_t;
+
+const bench_render_t RENDERS[] = {
+    {"centralized", FORK_TREE_LAYOUT_CENTRALIZED, 0},
+    {"dense", FORK_TREE_LAYOUT_DENSE, 0},
+    {"tidy", FORK_TREE_LAYOUT_TIDY, 0},
+    {"tidy_compact", FORK_TREE_LAYOUT_TIDY, FORK_TREE_SVG_COMPACT},
+    {"timeline", RENDER_TIMELINE, 0},
+    {"export", RENDER_EXPORT, 0},
+};
+#define NUMBER_OF_RENDERS ((int)(sizeof(RENDERS) / sizeof(RENDERS[0])))
+
+// Latency of the fork calls of every process of a run, in a shared mapping
+typedef struct ForkCounters {
+    _Atomic int64_t total;
+    _Atomic int64_t count;
+} fork_counters_t;
+
+typedef struct BenchOutput {
+    FILE *file;
+    int json;
+    int rows;
+} bench_output_t;
+
+// Tree of the run in progress, NULL when forking without recording
+fork_tree_t *BENCH_TREE = NULL;
+fork_counters_t *COUNTERS = NULL;
+
+int64_t bench_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Forks with or without the tree and adds the time the parent spent in the call to the counters.
+ */
+pid_t bench_fork(void) {
+    int64_t start = bench_now();
+    pid_t pid = BENCH_TREE != NULL ? fork_tree_fork(BENCH_TREE) : fork();
+    if (pid > 0) {
+        atomic_fetch_add_explicit(&COUNTERS->total, bench_now() - start, memory_order_relaxed);
+        atomic_fetch_add_explicit(&COUNTERS->count, 1, memory_order_relaxed);
+    }
+    return pid;
+}
+
+void bench_wait_children(void) {
+    while (wait(NULL) > 0)
+        ;
+}
+
+/**
+ * Creates size children of the root, which exit right away.
+ */
+void shape_fanout(int size) {
+    for (int i = 0; i < size; i++) {
+        if (bench_fork() == 0) {
+            _exit(0);
+        }
+    }
+    bench_wait_children();
+}
+
+/**
+ * Creates a chain of size generations, each process forks one child and waits for it.
+ */
+void shape_chain(int size) {
+    pid_t root_process_id = getpid();
+
+    int i = 0;
+    while (i < size && bench_fork() == 0) {
+        i++;
+    }
+    bench_wait_children();
+
+    if (getpid() != root_process_id) {
+        _exit(0);
+    }
+}
+
+/**
+ * Every process forks the remaining times, like examples/example-2.c, for 2^k - 1 forks.
+ */
+void shape_binary(int size) {
+    pid_t root_process_id = getpid();
+
+    int forks = 0;
+    while (((2 << forks) - 1) <= size) {
+        forks++;
+    }
+
+    for (int i = 0; i < forks; i++) {
+        bench_fork();
+    }
+    bench_wait_children();
+
+    if (getpid() != root_process_id) {
+        _exit(0);
+    }
+}
+
+/**
+ * Splits the size remaining descendants of a process in random subtrees.
+ * Children are seeded by their parent, so a seed always gives the same tree.
+ */
+void shape_random_subtree(int size, unsigned int seed) {
+    srand(seed);
+    while (size > 0) {
+        int subtree_size = 1 + rand() % size;
+        unsigned int child_seed = (unsigned int)rand();
+        if (bench_fork() == 0) {
+            shape_random_subtree(subtree_size - 1, child_seed);
+            _exit(0);
+        }
+        size -= subtree_size;
+    }
+    bench_wait_children();
+}
+
+void shape_build(int shape, int size) {
+    switch (shape) {
+    case SHAPE_FANOUT:
+        shape_fanout(size);
+        break;
+    case SHAPE_CHAIN:
+        shape_chain(size);
+        break;
+    case SHAPE_BINARY:
+        shape_binary(size);
+        break;
+    default:
+        shape_random_subtree(size, 42);
+        break;
+    }
+}
+
+void bench_output_begin(bench_output_t *output) {
+    if (output->json) {
+        fprintf(output->file, "[\n");
+    } else {
+        fprintf(output->file, "shape,nodes,benchmark,metric,value\n");
+    }
+}
+
+void bench_output_row(bench_output_t *output, int shape, int nodes, const char *benchmark, const char *metric, double value) {
+    if (output->json) {
+        fprintf(output->file, "%s  {\"shape\": \"%s\", \"nodes\": %d, \"benchmark\": \"%s\", \"metric\": \"%s\", \"value\": %.3f}",
+                output->rows > 0 ? ",\n" : "", SHAPE_NAMES[shape], nodes, benchmark, metric, value);
+    } else {
+        fprintf(output->file, "%s,%d,%s,%s,%.3f\n", SHAPE_NAMES[shape], nodes, benchmark, metric, value);
+    }
+    output->rows++;
+}
+
+void bench_output_end(bench_output_t *output) {
+    if (output->json) {
+        fprintf(output->file, "\n]\n");
+    }
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+double median(double *values, int count) {
+    qsort(values, count, sizeof(double), compare_doubles);
+    return count % 2 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+/**
+ * Builds the shape once, with the tree when tree is not NULL.
+ * Returns the nanoseconds the parents spent per fork call, and the whole build in total_time.
+ */
+double bench_record_run(fork_tree_t *tree, int shape, int size, double *total_time) {
+    atomic_store(&COUNTERS->total, 0);
+    atomic_store(&COUNTERS->count, 0);
+    BENCH_TREE = tree;
+
+    int64_t start = bench_now();
+    shape_build(shape, size);
+    *total_time = (double)(bench_now() - start);
+
+    BENCH_TREE = NULL;
+    int64_t count = atomic_load(&COUNTERS->count);
+    return count == 0 ? 0 : (double)atomic_load(&COUNTERS->total) / count;
+}
+
+/**
+ * Renders the snapshot in a child, so its peak RSS is the one of the render alone.
+ * The child sends back the time and the bytes of the render.
+ */
+int bench_render(bench_output_t *output, fork_tree_t *tree, int shape, int nodes, const bench_render_t *render, int number_of_threads) {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) == -1) {
+        printf("Error creating pipe\n");
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        printf("Error forking\n");
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        close(pipe_fds[0]);
+        int64_t results[2] = {-1, 0};
+        FILE *file = tmpfile();
+        fork_tree_snapshot_t snapshot;
+
+        if (file != NULL && fork_tree_snapshot_take(tree, &snapshot) == 0) {
+            snapshot.number_of_threads = number_of_threads;
+            int64_t start = bench_now();
+            int result;
+            if (render->layout == RENDER_EXPORT) {
+                result = fork_tree_export(tree, file);
+            } else if (render->layout == RENDER_TIMELINE) {
+                result = fork_tree_snapshot_render_timeline_svg(&snapshot, file);
+            } else {
+                result = fork_tree_snapshot_render_svg(&snapshot, file, render->layout, render->flags);
+            }
+            if (result == 0 && fflush(file) == 0) {
+                results[0] = bench_now() - start;
+                results[1] = ftell(file);
+            }
+            fork_tree_snapshot_free(&snapshot);
+        }
+
+        ssize_t written = write(pipe_fds[1], results, sizeof(results));
+        _exit(written == sizeof(results) ? 0 : 1);
+    }
+
+    close(pipe_fds[1]);
+    int64_t results[2] = {-1, 0};
+    ssize_t length = read(pipe_fds[0], results, sizeof(results));
+    close(pipe_fds[0]);
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == -1 || length != sizeof(results) || results[0] < 0) {
+        printf("Error rendering %s %s\n", SHAPE_NAMES[shape], render->name);
+        return -1;
+    }
+
+    bench_output_row(output, shape, nodes, render->name, "render_ms", (double)results[0] / 1000000);
+    bench_output_row(output, shape, nodes, render->name, "bytes_per_node", (double)results[1] / nodes);
+    bench_output_row(output, shape, nodes, render->name, "peak_rss_kb", (double)usage.ru_maxrss);
+    return 0;
+}
+
+int bench_shape(bench_output_t *output, int shape, int size, int repetitions, int number_of_threads) {
+    double *fork_times = malloc(sizeof(double) * repetitions * 4);
+    if (fork_times == NULL) {
+        printf("Error allocating memory\n");
+        return -1;
+    }
+    double *tree_fork_times = fork_times + repetitions;
+    double *build_times = tree_fork_times + repetitions;
+    double *tree_build_times = build_times + repetitions;
+
+    fork_tree_t tree;
+    int nodes = 0;
+    for (int i = 0; i < repetitions; i++) {
+        fork_times[i] = bench_record_run(NULL, shape, size, &build_times[i]);
+
+        if (fork_tree_init(&tree) == -1) {
+            printf("Error initializing tree\n");
+            free(fork_times);
+            return -1;
+        }
+        tree_fork_times[i] = bench_record_run(&tree, shape, size, &tree_build_times[i]);
+        nodes = atomic_load(&COUNTERS->count);
+
+        // The tree of the last repetition is rendered
+        if (i + 1 < repetitions) {
+            fork_tree_destroy(&tree);
+        }
+    }
+
+    double fork_time = median(fork_times, repetitions);
+    double tree_fork_time = median(tree_fork_times, repetitions);
+    bench_output_row(output, shape, nodes, "fork", "ns_per_fork", fork_time);
+    bench_output_row(output, shape, nodes, "fork_tree_fork", "ns_per_fork", tree_fork_time);
+    bench_output_row(output, shape, nodes, "fork_tree_fork", "overhead_ns_per_fork", tree_fork_time - fork_time);
+    bench_output_row(output, shape, nodes, "fork", "build_ms", median(build_times, repetitions) / 1000000);
+    bench_output_row(output, shape, nodes, "fork_tree_fork", "build_ms", median(tree_build_times, repetitions) / 1000000);
+    free(fork_times);
+
+    int result = 0;
+    for (int i = 0; i < NUMBER_OF_RENDERS && result == 0; i++) {
+        result = bench_render(output, &tree, shape, nodes, &RENDERS[i], number_of_threads);
+    }
+
+    fork_tree_destroy(&tree);
+    return result;
+}
+
+void usage(const char *name) {
+    printf("Usage: %s [-n nodes]... [-r repetitions] [-j threads] [-s shape]... [-f csv|json] [-o output]\n", name);
+    printf("  -n  number of forks of each tree, 256 and 1024 by default, can be repeated\n");
+    printf("  -r  number of times each tree is recorded, the median is reported, %d by default\n", DEFAULT_REPETITIONS);
+    printf("  -j  number of threads of the renders, every online core by default\n");
+    printf("  -s  fanout, chain, binary or random, every shape by default, can be repeated\n");
+    printf("  -f  format of the results, csv by default\n");
+    printf("  -o  file the results are written to, the standard output by default\n");
+}
+
+// Measures recording and rendering on trees of several shapes and sizes
+int main(int argc, char *argv[]) {
+    int sizes[MAX_SIZES];
+    int number_of_sizes = 0;
+    int shapes[NUMBER_OF_SHAPES] = {0};
+    int any_shape = 0;
+    int repetitions = DEFAULT_REPETITIONS;
+    int number_of_threads = 0;
+    bench_output_t output = {stdout, 0, 0};
+    const char *path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc && number_of_sizes < MAX_SIZES) {
+            sizes[number_of_sizes++] = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            repetitions = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            number_of_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            i++;
+            int shape = 0;
+            while (shape < NUMBER_OF_SHAPES && strcmp(argv[i], SHAPE_NAMES[shape]) != 0) {
+                shape++;
+            }
+            if (shape == NUMBER_OF_SHAPES) {
+                usage(argv[0]);
+                return 1;
+            }
+            shapes[shape] = 1;
+            any_shape = 1;
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "csv") != 0 && strcmp(argv[i], "json") != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            output.json = strcmp(argv[i], "json") == 0;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            path = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (number_of_sizes == 0) {
+        sizes[number_of_sizes++] = 256;
+        sizes[number_of_sizes++] = 1024;
+    }
+    for (int i = 0; i < number_of_sizes; i++) {
+        if (sizes[i] < 1) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (repetitions < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    COUNTERS = mmap(NULL, sizeof(fork_counters_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (COUNTERS == MAP_FAILED) {
+        printf("Error mapping counters\n");
+        return 1;
+    }
+
+    if (path != NULL) {
+        output.file = fopen(path, "w");
+        if (output.file == NULL) {
+            printf("Error opening %s\n", path);
+            return 1;
+        }
+    }
+
+    // Results are written as they come, a crash keeps the previous ones
+    setvbuf(output.file, NULL, _IOLBF, 0);
+
+    int result = 0;
+    bench_output_begin(&output);
+    for (int shape = 0; shape < NUMBER_OF_SHAPES && result == 0; shape++) {
+        if (any_shape && !shapes[shape]) {
+            continue;
+        }
+        for (int i = 0; i < number_of_sizes && result == 0; i++) {
+            result = bench_shape(&output, shape, sizes[i], repetitions, number_of_threads);
+        }
+    }
+    bench_output_end(&output);
+
+    if (path != NULL && fclose(output.file) == EOF) {
+        printf("Error writing %s\n", path);
+        return 1;
+    }
+    return result == 0 ? 0 : 1;
+}
@@ -0,0 +1,408 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../fork_tree.h"
+
+#define DEFAULT_ITERATIONS 2000
+
+// Shared by the harness and its workers
+typedef struct StressShared {
+    // Workers wait for all of them to be ready, so they start forking at the same time
+    atomic_int ready;
+    atomic_int start;
+    // Ground truth, the pids returned by fork_tree_fork to each thread of each worker, -1 for a failed fork
+    pid_t *children;
+    // Nanoseconds of each call of each thread of each worker
+    int64_t *latencies;
+} stress_shared_t;
+
+// One forking thread of a worker, the threads of a worker share its copy of the tree
+typedef struct StressThread {
+    fork_tree_t *tree;
+    stress_shared_t *shared;
+    // Index of the thread among the threads of every worker
+    int lane;
+    int iterations;
+    pthread_t thread;
+} stress_thread_t;
+
+typedef struct StressResult {
+    int workers;
+    int threads;
+    long long forks;
+    long long failed;
+    double seconds;
+    int64_t p50;
+    int64_t p99;
+    int64_t p999;
+    double record_mean;
+    long long record_max;
+    long long lost;
+    long long duplicated;
+    long long unexpected;
+} stress_result_t;
+
+typedef struct ParentChild {
+    pid_t parent;
+    pid_t child;
+} parent_child_t;
+
+int64_t stress_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Forks and reaps iterations children as fast as possible, the children exit right away.
+ */
+void *stress_thread(void *argument) {
+    stress_thread_t *thread = argument;
+    stress_shared_t *shared = thread->shared;
+    pid_t *children = shared->children + (size_t)thread->lane * thread->iterations;
+    int64_t *latencies = shared->latencies + (size_t)thread->lane * thread->iterations;
+
+    atomic_fetch_add(&shared->ready, 1);
+    while (atomic_load(&shared->start) == 0)
+        ;
+
+    for (int i = 0; i < thread->iterations; i++) {
+        int64_t start = stress_now();
+        pid_t pid = fork_tree_fork(thread->tree);
+        if (pid == 0) {
+            _exit(0);
+        }
+        latencies[i] = stress_now() - start;
+        children[i] = pid;
+        if (pid > 0) {
+            waitpid(pid, NULL, 0);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Runs number_of_threads forking threads in the worker, which all fork from the same copy of the tree.
+ */
+void stress_worker(fork_tree_t *tree, stress_shared_t *shared, int worker, int number_of_threads, int iterations) {
+    stress_thread_t threads[number_of_threads];
+    for (int i = 0; i < number_of_threads; i++) {
+        threads[i].tree = tree;
+        threads[i].shared = shared;
+        threads[i].lane = worker * number_of_threads + i;
+        threads[i].iterations = iterations;
+    }
+
+    // The first thread is the worker itself, a thread that can't be created is marked as failed forks
+    int started = 1;
+    for (; started < number_of_threads; started++) {
+        if (pthread_create(&threads[started].thread, NULL, stress_thread, &threads[started]) != 0) {
+            break;
+        }
+    }
+    for (int i = started; i < number_of_threads; i++) {
+        atomic_fetch_add(&shared->ready, 1);
+        for (int j = 0; j < iterations; j++) {
+            shared->children[(size_t)threads[i].lane * iterations + j] = -1;
+            shared->latencies[(size_t)threads[i].lane * iterations + j] = 0;
+        }
+    }
+
+    stress_thread(&threads[0]);
+    for (int i = 1; i < started; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+}
+
+int compare_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+int compare_parent_child(const void *a, const void *b) {
+    const parent_child_t *x = a;
+    const parent_child_t *y = b;
+    if (x->parent != y->parent) {
+        return (x->parent > y->parent) - (x->parent < y->parent);
+    }
+    return (x->child > y->child) - (x->child < y->child);
+}
+
+typedef struct StressRecords {
+    parent_child_t *records;
+    long long size;
+    long long capacity;
+} stress_records_t;
+
+int stress_add_record(void *context, const fork_tree_record_t *record) {
+    stress_records_t *records = context;
+    if (records->size == records->capacity) {
+        long long capacity = records->capacity > 0 ? records->capacity * 2 : 1024;
+        parent_child_t *grown = realloc(records->records, sizeof(parent_child_t) * capacity);
+        if (grown == NULL) {
+            return -1;
+        }
+        records->records = grown;
+        records->capacity = capacity;
+    }
+    records->records[records->size].parent = record->parent;
+    records->records[records->size++].child = record->child;
+    return 0;
+}
+
+/**
+ * Reads every record of the tree, reachable from the root or not.
+ * Returns the number of records, -1 on error. records must be freed.
+ */
+long long stress_read_records(fork_tree_t *tree, parent_child_t **records) {
+    stress_records_t read = {NULL, 0, 0};
+    if (fork_tree_for_each_record(tree, stress_add_record, &read) != 0) {
+        printf("Error reading records\n");
+        free(read.records);
+        *records = NULL;
+        return -1;
+    }
+    *records = read.records;
+    return read.size;
+}
+
+/**
+ * Compares the recorded forks with the ground truth, both sorted.
+ * A pid can be reused once its process is reaped, so records are compared as multisets.
+ */
+void stress_verify(stress_result_t *result, parent_child_t *truth, long long truth_size, parent_child_t *records, long long number_of_records) {
+    qsort(truth, truth_size, sizeof(parent_child_t), compare_parent_child);
+    qsort(records, number_of_records, sizeof(parent_child_t), compare_parent_child);
+
+    long long i = 0;
+    long long j = 0;
+    while (i < truth_size || j < number_of_records) {
+        int order = i == truth_size ? 1 : j == number_of_records ? -1 : compare_parent_child(&truth[i], &records[j]);
+        if (order == 0) {
+            i++;
+            j++;
+        } else if (order < 0) {
+            result->lost++;
+            i++;
+        } else {
+            // A record of a fork that was already matched is a duplicate, any other was never forked
+            if (j > 0 && compare_parent_child(&records[j - 1], &records[j]) == 0) {
+                result->duplicated++;
+            } else {
+                result->unexpected++;
+            }
+            j++;
+        }
+    }
+}
+
+/**
+ * Runs number_of_workers workers forked by the root, each with number_of_threads threads which fork iterations children each.
+ */
+int stress_run(stress_result_t *result, int number_of_workers, int number_of_threads, int iterations) {
+    memset(result, 0, sizeof(stress_result_t));
+    result->workers = number_of_workers;
+    result->threads = number_of_threads;
+
+    size_t calls = (size_t)number_of_workers * number_of_threads * iterations;
+    size_t shared_size = sizeof(stress_shared_t) + calls * (sizeof(pid_t) + sizeof(int64_t)) + sizeof(int64_t);
+    stress_shared_t *shared = mmap(NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        printf("Error mapping shared memory\n");
+        return -1;
+    }
+    shared->latencies = (int64_t *)(shared + 1);
+    shared->children = (pid_t *)(shared->latencies + calls);
+
+    fork_tree_t tree;
+    fork_tree_options_t options = {.flags = FORK_TREE_STATS};
+    if (fork_tree_init_with_options(&tree, &options) == -1) {
+        printf("Error initializing tree\n");
+        munmap(shared, shared_size);
+        return -1;
+    }
+
+    pid_t *workers = malloc(sizeof(pid_t) * number_of_workers);
+    parent_child_t *truth = malloc(sizeof(parent_child_t) * (calls + number_of_workers));
+    if (workers == NULL || truth == NULL) {
+        printf("Error allocating memory\n");
+        free(workers);
+        free(truth);
+        fork_tree_destroy(&tree);
+        munmap(shared, shared_size);
+        return -1;
+    }
+
+    int started = 0;
+    for (; started < number_of_workers; started++) {
+        workers[started] = fork_tree_fork(&tree);
+        if (workers[started] == 0) {
+            stress_worker(&tree, shared, started, number_of_threads, iterations);
+            _exit(0);
+        }
+        if (workers[started] == -1) {
+            printf("Error forking worker\n");
+            break;
+        }
+    }
+
+    while (atomic_load(&shared->ready) < started * number_of_threads)
+        ;
+    int64_t start = stress_now();
+    atomic_store(&shared->start, 1);
+    for (int i = 0; i < started; i++) {
+        waitpid(workers[i], NULL, 0);
+    }
+    result->seconds = (double)(stress_now() - start) / 1000000000;
+
+    int error = started < number_of_workers;
+    long long truth_size = 0;
+    for (int i = 0; i < started; i++) {
+        truth[truth_size].parent = getpid();
+        truth[truth_size++].child = workers[i];
+        for (size_t j = 0; j < (size_t)number_of_threads * iterations; j++) {
+            pid_t child = shared->children[(size_t)i * number_of_threads * iterations + j];
+            if (child == -1) {
+                result->failed++;
+                continue;
+            }
+            truth[truth_size].parent = workers[i];
+            truth[truth_size++].child = child;
+            result->forks++;
+        }
+    }
+
+    if (!error) {
+        qsort(shared->latencies, calls, sizeof(int64_t), compare_int64);
+        result->p50 = shared->latencies[calls * 50 / 100];
+        result->p99 = shared->latencies[calls * 99 / 100];
+        result->p999 = shared->latencies[calls * 999 / 1000];
+
+        fork_tree_stats_t stats;
+        if (fork_tree_get_stats(&tree, &stats) == 0 && stats.record.count > 0) {
+            result->record_mean = (double)stats.record.total / stats.record.count;
+            result->record_max = stats.record.max;
+        }
+
+        parent_child_t *records;
+        long long number_of_records = stress_read_records(&tree, &records);
+        if (number_of_records == -1) {
+            error = 1;
+        } else {
+            stress_verify(result, truth, truth_size, records, number_of_records);
+            free(records);
+        }
+    }
+
+    free(workers);
+    free(truth);
+    fork_tree_destroy(&tree);
+    munmap(shared, shared_size);
+    return error ? -1 : 0;
+}
+
+void stress_print(FILE *file, int json, int first, stress_result_t *result) {
+    double throughput = result->seconds > 0 ? result->forks / result->seconds : 0;
+    if (json) {
+        fprintf(file, "%s  {\"workers\": %d, \"threads\": %d, \"forks\": %lld, \"failed\": %lld, \"seconds\": %.6f, \"forks_per_second\": %.1f, "
+                      "\"p50_ns\": %lld, \"p99_ns\": %lld, \"p999_ns\": %lld, \"record_mean_ns\": %.1f, \"record_max_ns\": %lld, "
+                      "\"lost\": %lld, \"duplicated\": %lld, \"unexpected\": %lld}",
+                first ? "" : ",\n", result->workers, result->threads, result->forks, result->failed, result->seconds, throughput,
+                (long long)result->p50, (long long)result->p99, (long long)result->p999, result->record_mean, result->record_max,
+                result->lost, result->duplicated, result->unexpected);
+    } else {
+        fprintf(file, "%d,%d,%lld,%lld,%.6f,%.1f,%lld,%lld,%lld,%.1f,%lld,%lld,%lld,%lld\n",
+                result->workers, result->threads, result->forks, result->failed, result->seconds, throughput,
+                (long long)result->p50, (long long)result->p99, (long long)result->p999, result->record_mean, result->record_max,
+                result->lost, result->duplicated, result->unexpected);
+    }
+}
+
+void usage(const char *name) {
+    printf("Usage: %s [-n iterations] [-w workers] [-t threads] [-f csv|json] [-o output]\n", name);
+    printf("  -n  number of forks of each thread, %d by default\n", DEFAULT_ITERATIONS);
+    printf("  -w  runs with 1 to this many workers, every online core by default\n");
+    printf("  -t  number of threads forking in each worker, 1 by default\n");
+    printf("  -f  format of the results, csv by default\n");
+    printf("  -o  file the results are written to, the standard output by default\n");
+}
+
+// Measures concurrent forks of 1 to N workers and checks that every fork is recorded exactly once
+int main(int argc, char *argv[]) {
+    int iterations = DEFAULT_ITERATIONS;
+    int max_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = 1;
+    int json = 0;
+    const char *path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            max_workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "csv") != 0 && strcmp(argv[i], "json") != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            json = strcmp(argv[i], "json") == 0;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            path = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (iterations < 1 || max_workers < 1 || threads < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *file = stdout;
+    if (path != NULL) {
+        file = fopen(path, "w");
+        if (file == NULL) {
+            printf("Error opening %s\n", path);
+            return 1;
+        }
+    }
+    setvbuf(file, NULL, _IOLBF, 0);
+
+    if (json) {
+        fprintf(file, "[\n");
+    } else {
+        fprintf(file, "workers,threads,forks,failed,seconds,forks_per_second,p50_ns,p99_ns,p999_ns,record_mean_ns,record_max_ns,lost,duplicated,unexpected\n");
+    }
+
+    int failed = 0;
+    for (int workers = 1; workers <= max_workers && !failed; workers++) {
+        stress_result_t result;
+        failed = stress_run(&result, workers, threads, iterations) == -1;
+        if (!failed) {
+            stress_print(file, json, workers == 1, &result);
+            failed = result.lost > 0 || result.duplicated > 0 || result.unexpected > 0;
+        }
+    }
+
+    if (json) {
+        fprintf(file, "\n]\n");
+    }
+    if (path != NULL && fclose(file) == EOF) {
+        printf("Error writing %s\n", path);
+        return 1;
+    }
+    return failed ? 1 : 0;
+}
@@ -1,9 +1,16 @@
 #include "fork_tree.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
 
 #define CIRCLE_SIZE 60
 #define CIRCLE_MARGIN_X 40
@@ -15,144 +22,318 @@
 #define LINE_COLOR "#000000"
 #define TEXT_COLOR "#FFFFFF"
 #define CONNECTOR_COLOR "#FF0000"
+#define FOLD_TEXT_COLOR "#000000"
+#define FOLD_TEXT_SIZE 11
+// Height under the deepest nodes taken by the labels of a folded render
+#define FOLD_LABEL_HEIGHT 30
+#define TEXT_FONT_FAMILY "-apple-system,system-ui,BlinkMacSystemFont,'Segoe UI',Roboto,'Helvetica Neue',Arial,sans-serif"
+
+// Timeline: the time span of the snapshot is drawn TIMELINE_WIDTH wide, with one row per process
+#define TIMELINE_WIDTH 1200
+#define TIMELINE_LABEL_WIDTH 240
+#define TIMELINE_AXIS_HEIGHT 30
+#define TIMELINE_ROW_HEIGHT 24
+#define TIMELINE_BAR_HEIGHT 16
+#define TIMELINE_TICKS 10
+#define TIMELINE_TEXT_COLOR "#000000"
+#define TIMELINE_GRID_COLOR "#DDDDDD"
+#define TIMELINE_RUNNING_COLOR "#888888"
+
+// Heatmap: nodes go from the cold to the hot color, and are scaled down to HEAT_MIN_SCALE of their size
+#define HEAT_COLD_COLOR 0x3B4CC0
+#define HEAT_HOT_COLOR 0xD7191C
+#define HEAT_MIN_SCALE 0.4
 
 #define CIRCLE_SHADOW_COLOR "#000000"
 #define CIRCLE_SHADOW_BLUR "5"
 #define CIRCLE_SHADOW_COLOR_OPACITY "0.2"
 
+// Size of the buffer the SVG is formatted into, it is written out with one write when full
+#define EMITTER_BUFFER_SIZE (1 << 20)
+// Initial size of the buffers the chunks of big trees are formatted into by the threads, they grow as needed
+#define EMITTER_CHUNK_BUFFER_SIZE (1 << 16)
+// Number of nodes of each chunk
+#define EMITTER_CHUNK_NODES 1024
+// Number of chunks formatted per thread before they are written out, which bounds the memory used
+#define EMITTER_CHUNKS_PER_THREAD 4
+
+// First bytes of the files written by fork_tree_export, followed by the version of the format
+#define TRACE_MAGIC "FTRE"
+#define TRACE_VERSION 3
+// Longest varint of a 64 bits value
+#define TRACE_MAX_VARINT_SIZE 10
+// Longest record of a fork, its 9 varints
+#define TRACE_MAX_RECORD_SIZE (9 * TRACE_MAX_VARINT_SIZE)
+// Size of the buffer the records are encoded into before they are written, whatever the size of the tree
+#define TRACE_BUFFER_SIZE (1 << 16)
+
+// Trees smaller than this are laid out by the calling thread only
+#define PARALLEL_MIN_NODES (1 << 16)
+// Number of subtree runs per thread, so threads that finish early have work to steal
+#define PARALLEL_TASKS_PER_THREAD 8
+// Minimum number of nodes of a run, smaller runs cost more to schedule than to lay out
+#define PARALLEL_MIN_GRAIN 1024
+
+// First bytes of the header of the trees, so the files of trees backed by a file can be recognized
+#define STORE_MAGIC "FTST"
+#define STORE_VERSION 6
 
 int GLOBAL_COUNTER = 0;
-// Number of nodes per page
-// If the number of nodes is greater than the number of nodes per page, new pages are created.
-#define NODE_PER_PAGE 20
+// Copy of the tree initialized with FORK_TREE_RECORD_EXIT for the exit handler,
+// since the tree of the program may be gone by the time the handlers run
+fork_tree_t EXIT_TREE;
+int EXIT_HANDLER_REGISTERED = 0;
+// Minimum number of nodes the nodes file grows to.
+// When the file is full its capacity doubles, so growing is amortized over the forks.
+#define MIN_CAPACITY 256
+// Number of nodes reserved in the address space of the nodes mapping, unless a bigger capacity is requested.
+// Only the truncated part of the reservation is backed by memory.
+#define DEFAULT_RESERVED_NODES (1 << 24)
+// Number of nodes in the first segment a process claims on its first fork.
+// Every following segment of the same process doubles, up to MAX_SEGMENT_SIZE,
+// so processes that fork once waste no slot and only the ones that keep forking claim big segments.
+// Nodes are 64 bytes, a cache line each, so segments never share a cache line.
+#define FIRST_SEGMENT_SIZE 1
+#define MAX_SEGMENT_SIZE 1024
+// Size of the huge pages used when FORK_TREE_HUGE_PAGES is set
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB 0x0004U
+#endif
+
+typedef struct ProcessUsage {
+    // Microseconds of CPU time
+    int64_t user_time;
+    int64_t system_time;
+    // Kilobytes
+    int32_t max_rss;
+    int32_t voluntary_switches;
+    int32_t involuntary_switches;
+} process_usage_t;
+
+typedef struct ChildSlots {
+    // Open addressing table of the children forked by this process, 0 marks an empty entry
+    pid_t *pids;
+    int *slots;
+    int table_bits;
+    int size;
+} child_slots_t;
+
+typedef struct SharedHistogram {
+    _Atomic int64_t buckets[FORK_TREE_STATS_BUCKETS];
+    _Atomic int64_t count;
+    _Atomic int64_t total;
+    _Atomic int64_t max;
+} shared_histogram_t;
 
 typedef struct SharedTree {
+    char magic[4];
+    int version;
+    // Only taken to grow the nodes file, appending a node is lock-free
     sem_t sem;
     pid_t root_process_id;
     int tree_id;
-    int pages_fd;
-    int number_of_pages;
+    // Nonzero if the nodes file is backed by huge pages
+    int huge_pages;
+    // Number of nodes reserved in the address space, the nodes file never grows past it
+    int reserved_nodes;
+    // Length of the nodes mapping
+    size_t reserved_size;
+    // Offset of the nodes in the nodes file, nonzero when the header and the nodes share a file given by the user
+    size_t nodes_offset;
+    // Number of nodes the nodes file was truncated to
+    atomic_int capacity;
+    // Next free slot, each process claims a segment of slots with a compare and swap, it never goes past reserved_nodes
+    atomic_int next_slot;
+    // Set by the first process that finds the tree full, which is the only one to report it
+    atomic_int full;
+    // CLOCK_MONOTONIC nanoseconds when the tree was initialized and when the root exited, 0 until it does
+    int64_t start_time;
+    _Atomic int64_t root_exit_time;
+    // Nonzero if the tree was initialized with FORK_TREE_STATS, every process adds its samples to the same histograms
+    int stats_enabled;
+    shared_histogram_t record_stats;
+    shared_histogram_t lock_wait_stats;
+    shared_histogram_t grow_stats;
 } shared_tree_t;
 
-typedef struct TreePage {
-    int nodes[NODE_PER_PAGE];
-    int parent[NODE_PER_PAGE];
-} tree_page_t;
-
-typedef struct MapNode {
-    int key;
-    struct MapNode *left;
-    struct MapNode *right;
-    void *value;
-} map_node_t;
+typedef struct TreeNode {
+    // Set last, with release semantics, so readers never see a torn node
+    atomic_int published;
+    pid_t pid;
+    pid_t parent;
+    // Set once usage is written by fork_tree_wait4, when the parent reaps the child
+    atomic_int reaped;
+    // CLOCK_MONOTONIC nanoseconds, the exit time is written by the child itself, 0 until it exits
+    int64_t fork_time;
+    _Atomic int64_t exit_time;
+    process_usage_t usage;
+} tree_node_t;
+
+typedef struct NodeIndex {
+    // Open addressing table of dense indexes, -1 marks an empty slot
+    int *table;
+    int table_bits;
+    // Pid of each dense index
+    pid_t *pids;
+    int size;
+    int capacity;
+} node_index_t;
 
-double get_width(map_node_t **width_map, map_node_t *child_map, int node, int is_dense);
 char *fork_tree_gen_shared_tree_name_fd(int tree_number);
 char *fork_tree_gen_page_name_fd(char *base_string);
 
-void *map_get(map_node_t *root, int key) {
-    if (root == NULL) {
-        return NULL;
-    }
-    if (root->key == key) {
-        return root->value;
+typedef struct canvasRegion {
+    double min_x;
+    double min_y;
+    double max_x;
+    double max_y;
+} canvas_region_t;
+
+uint32_t node_index_hash(node_index_t *index, pid_t pid) {
+    // Fibonacci hashing spreads the mostly increasing pids over the whole table
+    return ((uint32_t)pid * 2654435769u) >> (32 - index->table_bits);
+}
+
+/**
+ * Creates an index for up to capacity pids.
+ * The table and the pids are allocated as one block.
+ */
+int node_index_create(node_index_t *index, int capacity) {
+    int table_bits = 4;
+    while ((1L << table_bits) < (long)capacity * 2) {
+        table_bits++;
     }
-    if (root->key > key) {
-        return map_get(root->left, key);
+    size_t table_size = (size_t)1 << table_bits;
+
+    int *block = malloc(sizeof(int) * table_size + sizeof(pid_t) * capacity);
+    if (block == NULL) {
+        return -1;
     }
-    return map_get(root->right, key);
+    memset(block, -1, sizeof(int) * table_size);
+
+    index->table = block;
+    index->table_bits = table_bits;
+    index->pids = (pid_t *)(block + table_size);
+    index->size = 0;
+    index->capacity = capacity;
+    return 0;
 }
 
-int map_put(map_node_t **root, int key, void *value) {
-    if (*root == NULL) {
-        *root = malloc(sizeof(map_node_t));
-        if (*root == NULL)
-            return -1;
-        (*root)->key = key;
-        (*root)->value = value;
-        (*root)->left = NULL;
-        (*root)->right = NULL;
-        return 0;
+/**
+ * Returns the dense index of pid, or -1 if it is not in the index.
+ */
+int node_index_get(node_index_t *index, pid_t pid) {
+    uint32_t mask = (1u << index->table_bits) - 1;
+    uint32_t slot = node_index_hash(index, pid);
+    while (index->table[slot] != -1) {
+        if (index->pids[index->table[slot]] == pid) {
+            return index->table[slot];
+        }
+        slot = (slot + 1) & mask;
     }
-    if ((*root)->key == key) {
-        (*root)->value = value;
-        return 0;
+    return -1;
+}
+
+/**
+ * Returns the dense index of pid, adding it if it is not in the index yet.
+ * Returns -1 if the index is full.
+ */
+int node_index_put(node_index_t *index, pid_t pid) {
+    uint32_t mask = (1u << index->table_bits) - 1;
+    uint32_t slot = node_index_hash(index, pid);
+    while (index->table[slot] != -1) {
+        if (index->pids[index->table[slot]] == pid) {
+            return index->table[slot];
+        }
+        slot = (slot + 1) & mask;
     }
-    if ((*root)->key > key) {
-        return map_put(&((*root)->left), key, value);
+
+    if (index->size == index->capacity) {
+        return -1;
     }
-    return map_put(&((*root)->right), key, value);
+
+    index->table[slot] = index->size;
+    index->pids[index->size] = pid;
+    return index->size++;
 }
 
-int map_destroy(map_node_t *root) {
-    if (root == NULL)
-        return 0;
-    map_destroy(root->left);
-    map_destroy(root->right);
-    free(root);
-    return 0;
+void node_index_destroy(node_index_t *index) {
+    free(index->table);
 }
 
-typedef struct LinkedListNode {
-    void *value;
-    struct LinkedListNode *next;
-} linked_list_node_t;
+/**
+ * Rounds a size up to a multiple of page_size.
+ */
+size_t fork_tree_round_size(size_t size, size_t page_size) {
+    return (size + page_size - 1) / page_size * page_size;
+}
 
-typedef struct LinkedList {
-    linked_list_node_t *head;
-    linked_list_node_t *tail;
-    int size;
+/**
+ * Current CLOCK_MONOTONIC time in nanoseconds, the clock of every recorded time.
+ */
+int64_t fork_tree_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
 
-} linked_list_t;
+void fork_tree_at_exit(void);
 
-typedef struct canvasRegion {
-    double min_x;
-    double min_y;
-    double max_x;
-    double max_y;
-} canvas_region_t;
+/**
+ * Maps the nodes file backed by huge pages.
+ * Huge pages can't be reserved lazily, so the whole capacity is truncated and reserved upfront.
+ * Returns NULL if there are not enough huge pages available.
+ */
+tree_node_t *fork_tree_map_huge_pages(int pages_fd, int expected_nodes, shared_tree_t *shared_tree) {
+    size_t size = fork_tree_round_size(sizeof(tree_node_t) * (size_t)expected_nodes, HUGE_PAGE_SIZE);
 
-int linked_list_add(linked_list_t *list, void *value) {
-    linked_list_node_t *node = malloc(sizeof(linked_list_node_t));
-    if (node == NULL)
-        return -1;
-    node->value = value;
-    node->next = NULL;
-    if (list->head == NULL) {
-        list->head = node;
-        list->tail = node;
-        list->size = 1;
-        return 0;
+    if (ftruncate(pages_fd, size) == -1) {
+        return NULL;
+    }
+
+    tree_node_t *nodes = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, pages_fd, 0);
+    if (nodes == MAP_FAILED) {
+        return NULL;
     }
-    list->tail->next = node;
-    list->tail = node;
-    list->size++;
-    return 0;
-}
 
-void linked_list_create(linked_list_t *list) {
-    list->head = NULL;
-    list->tail = NULL;
-    list->size = 0;
+    shared_tree->huge_pages = 1;
+    shared_tree->reserved_nodes = size / sizeof(tree_node_t);
+    shared_tree->reserved_size = size;
+    shared_tree->nodes_offset = 0;
+    atomic_init(&shared_tree->capacity, shared_tree->reserved_nodes);
+    return nodes;
 }
 
-void linked_list_destroy(linked_list_t *list) {
-    linked_list_node_t *node = list->head;
-    while (node != NULL) {
-        linked_list_node_t *next = node->next;
-        free(node);
-        node = next;
+/**
+ * Maps the nodes file from offset in a reserved range of the address space.
+ * Only expected_nodes are truncated, the rest of the reservation is backed when the file grows.
+ */
+tree_node_t *fork_tree_map_pages(int pages_fd, int expected_nodes, size_t offset, shared_tree_t *shared_tree) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    int reserved_nodes = expected_nodes > DEFAULT_RESERVED_NODES ? expected_nodes : DEFAULT_RESERVED_NODES;
+    size_t size = fork_tree_round_size(sizeof(tree_node_t) * (size_t)reserved_nodes, page_size);
+    int capacity = 0;
+
+    if (expected_nodes > 0) {
+        capacity = fork_tree_round_size(sizeof(tree_node_t) * (size_t)expected_nodes, page_size) / sizeof(tree_node_t);
+        if (ftruncate(pages_fd, offset + sizeof(tree_node_t) * (size_t)capacity) == -1) {
+            return NULL;
+        }
     }
-}
 
-void *map_in_order(map_node_t *root, linked_list_t *list) {
-    if (root == NULL)
+    tree_node_t *nodes = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, pages_fd, offset);
+    if (nodes == MAP_FAILED) {
         return NULL;
-    map_in_order(root->left, list);
-
-    linked_list_add(list, root->value);
+    }
 
-    map_in_order(root->right, list);
+    shared_tree->huge_pages = 0;
+    shared_tree->reserved_nodes = reserved_nodes;
+    shared_tree->reserved_size = size;
+    shared_tree->nodes_offset = offset;
+    atomic_init(&shared_tree->capacity, capacity);
+    return nodes;
 }
 
 /**
@@ -160,60 +341,204 @@ void *map_in_order(map_node_t *root, linked_list_t *list) {
  * IT IS NOT THREAD SAFE.
  */
 int fork_tree_init(fork_tree_t *tree) {
+    return fork_tree_init_with_options(tree, NULL);
+}
+
+/**
+ * This function initializes a tree with room for expected_nodes nodes.
+ * IT IS NOT THREAD SAFE.
+ */
+int fork_tree_init_with_capacity(fork_tree_t *tree, int expected_nodes) {
+    fork_tree_options_t options = {
+        .expected_nodes = expected_nodes,
+        .flags = 0};
+    return fork_tree_init_with_options(tree, &options);
+}
+
+/**
+ * This function initializes a tree with the given options, options can be NULL.
+ * IT IS NOT THREAD SAFE.
+ */
+int fork_tree_init_with_options(fork_tree_t *tree, const fork_tree_options_t *options) {
     memset(tree, 0, sizeof(fork_tree_t));
 
+    int expected_nodes = options == NULL ? 0 : options->expected_nodes;
+    int flags = options == NULL ? 0 : options->flags;
+    const char *path = options == NULL ? NULL : options->path;
+
+    if (expected_nodes < 0) {
+        return -1;
+    }
+
     char *tree_name = fork_tree_gen_shared_tree_name_fd(GLOBAL_COUNTER);
     if (tree_name == NULL) {
         return -1;
     }
-    int fd = syscall(SYS_memfd_create, tree_name, 0);
+
+    // A file given by the user holds the header in its first pages and the nodes after them
+    int fd;
+    size_t header_size = sizeof(shared_tree_t);
+    if (path != NULL) {
+        fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        header_size = fork_tree_round_size(sizeof(shared_tree_t), sysconf(_SC_PAGESIZE));
+    } else {
+        fd = syscall(SYS_memfd_create, tree_name, 0);
+    }
 
     if (fd == -1) {
+        if (path != NULL) {
+            printf("Error opening %s\n", path);
+        }
+        free(tree_name);
         return -1;
     }
 
     char *page_name = fork_tree_gen_page_name_fd(tree_name);
     if (page_name == NULL) {
         free(tree_name);
+        close(fd);
+        return -1;
+    }
+
+    if (ftruncate(fd, header_size) == -1) {
+        free(tree_name);
+        free(page_name);
+        close(fd);
+        return -1;
+    }
+
+    shared_tree_t *shared_tree = mmap(NULL, sizeof(shared_tree_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shared_tree == MAP_FAILED) {
+        free(tree_name);
+        free(page_name);
+        close(fd);
         return -1;
     }
 
-    int pages_fd = syscall(SYS_memfd_create, page_name, 0);
+    tree_node_t *nodes = NULL;
+    int pages_fd = -1;
+
+    // Falls back to regular pages when huge pages are not available
+    if (path != NULL) {
+        pages_fd = dup(fd);
+        if (pages_fd != -1) {
+            nodes = fork_tree_map_pages(pages_fd, expected_nodes, header_size, shared_tree);
+        }
+    } else if (flags & FORK_TREE_HUGE_PAGES) {
+        pages_fd = syscall(SYS_memfd_create, page_name, MFD_HUGETLB);
+        if (pages_fd != -1) {
+            nodes = fork_tree_map_huge_pages(pages_fd, expected_nodes > MIN_CAPACITY ? expected_nodes : MIN_CAPACITY, shared_tree);
+            if (nodes == NULL) {
+                close(pages_fd);
+                pages_fd = -1;
+            }
+        }
+    }
+
+    if (pages_fd == -1 && path == NULL) {
+        pages_fd = syscall(SYS_memfd_create, page_name, 0);
+        if (pages_fd != -1) {
+            nodes = fork_tree_map_pages(pages_fd, expected_nodes, 0, shared_tree);
+        }
+    }
 
     free(tree_name);
     free(page_name);
 
-    if (pages_fd == -1) {
+    if (nodes == NULL) {
+        if (pages_fd != -1) {
+            close(pages_fd);
+        }
+        munmap(shared_tree, sizeof(shared_tree_t));
+        close(fd);
+        return -1;
+    }
+
+    memcpy(shared_tree->magic, STORE_MAGIC, sizeof(shared_tree->magic));
+    shared_tree->version = STORE_VERSION;
+    shared_tree->tree_id = GLOBAL_COUNTER;
+    shared_tree->root_process_id = options != NULL && options->root_process_id > 0 ? options->root_process_id : getpid();
+    shared_tree->start_time = fork_tree_now();
+    atomic_init(&shared_tree->root_exit_time, 0);
+    atomic_init(&shared_tree->next_slot, 0);
+    atomic_init(&shared_tree->full, 0);
+    shared_tree->stats_enabled = (flags & FORK_TREE_STATS) != 0;
+
+    if (sem_init(&(shared_tree->sem), 1, 1) == -1) {
+        munmap(nodes, shared_tree->reserved_size);
+        munmap(shared_tree, sizeof(shared_tree_t));
+        close(fd);
+        close(pages_fd);
+        return -1;
+    }
+
+    tree->shared_tree_fd = fd;
+    tree->pages_fd = pages_fd;
+    tree->shared_tree = shared_tree;
+    tree->nodes = nodes;
+    tree->own_pid = getpid();
+    tree->own_slot = -1;
+    atomic_flag_clear(&tree->lock);
+
+    GLOBAL_COUNTER++;
+
+    if (flags & FORK_TREE_RECORD_EXIT) {
+        EXIT_TREE = *tree;
+        if (!EXIT_HANDLER_REGISTERED) {
+            EXIT_HANDLER_REGISTERED = atexit(fork_tree_at_exit) == 0;
+        }
+    }
+
+    return 0;
+}
+
+int fork_tree_attach(fork_tree_t *tree, const char *path) {
+    memset(tree, 0, sizeof(fork_tree_t));
+
+    int fd = open(path, O_RDWR);
+    if (fd == -1) {
+        printf("Error opening %s\n", path);
         return -1;
     }
 
-    if (ftruncate(fd, sizeof(shared_tree_t)) == -1) {
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1 || (size_t)file_stat.st_size < sizeof(shared_tree_t)) {
+        printf("Error not a fork tree file\n");
         close(fd);
         return -1;
     }
 
     shared_tree_t *shared_tree = mmap(NULL, sizeof(shared_tree_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     if (shared_tree == MAP_FAILED) {
+        printf("Error mapping %s\n", path);
+        close(fd);
         return -1;
     }
 
-    shared_tree->tree_id = GLOBAL_COUNTER;
-    shared_tree->root_process_id = getpid();
-    shared_tree->pages_fd = pages_fd;
-    shared_tree->number_of_pages = 0;
-
-    if (sem_init(&(shared_tree->sem), 1, 1) == -1) {
+    if (memcmp(shared_tree->magic, STORE_MAGIC, sizeof(shared_tree->magic)) != 0 || shared_tree->version != STORE_VERSION || shared_tree->nodes_offset < sizeof(shared_tree_t)) {
+        printf("Error not a fork tree file\n");
         munmap(shared_tree, sizeof(shared_tree_t));
         close(fd);
         return -1;
     }
 
-    munmap(shared_tree, sizeof(shared_tree_t));
+    // The whole reservation is mapped, like the tree did, only the truncated part is ever touched
+    tree_node_t *nodes = mmap(NULL, shared_tree->reserved_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, shared_tree->nodes_offset);
+    if (nodes == MAP_FAILED) {
+        printf("Error mapping %s\n", path);
+        munmap(shared_tree, sizeof(shared_tree_t));
+        close(fd);
+        return -1;
+    }
 
     tree->shared_tree_fd = fd;
-
-    GLOBAL_COUNTER++;
-
+    tree->pages_fd = fd;
+    tree->shared_tree = shared_tree;
+    tree->nodes = nodes;
+    tree->own_pid = getpid();
+    tree->own_slot = -1;
+    atomic_flag_clear(&tree->lock);
+    tree->attached = 1;
     return 0;
 }
 
@@ -250,679 +575,2912 @@ char *fork_tree_gen_page_name_fd(char *base_string) {
 }
 
 shared_tree_t *fork_tree_get_shared_tree(fork_tree_t *tree) {
-    shared_tree_t *shared_tree = mmap(NULL, sizeof(shared_tree_t), PROT_READ | PROT_WRITE, MAP_SHARED, tree->shared_tree_fd, 0);
-    if (shared_tree == MAP_FAILED) {
-        return NULL;
-    }
-    return shared_tree;
+    return tree->shared_tree;
 }
 
-int fork_tree_add_node(fork_tree_t *tree, pid_t parent_pid, pid_t child_pid) {
-    shared_tree_t *shared_tree = fork_tree_get_shared_tree(tree);
+/**
+ * Adds a sample of the given nanoseconds to a histogram shared by every process.
+ */
+void shared_histogram_add(shared_histogram_t *histogram, int64_t duration) {
+    if (duration < 0) {
+        duration = 0;
+    }
 
-    if (shared_tree == NULL) {
-        printf("Error getting shared tree\n");
-        return -1;
+    int bucket = duration == 0 ? 0 : 64 - __builtin_clzll((unsigned long long)duration);
+    if (bucket >= FORK_TREE_STATS_BUCKETS) {
+        bucket = FORK_TREE_STATS_BUCKETS - 1;
     }
 
-    sem_wait(&shared_tree->sem);
+    atomic_fetch_add_explicit(&histogram->buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->total, duration, memory_order_relaxed);
 
-    if (shared_tree->number_of_pages == 0) {
-        if (ftruncate(shared_tree->pages_fd, sizeof(tree_page_t)) == -1) {
-            printf("Error truncating pages file\n");
-            sem_post(&shared_tree->sem);
-            return -1;
-        }
-        shared_tree->number_of_pages++;
+    int64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    while (max < duration && !atomic_compare_exchange_weak_explicit(&histogram->max, &max, duration, memory_order_relaxed, memory_order_relaxed)) {
     }
+}
 
-    tree_page_t *pages = mmap(
-        NULL,
-        sizeof(tree_page_t) * shared_tree->number_of_pages,
-        PROT_READ | PROT_WRITE, MAP_SHARED,
-        shared_tree->pages_fd, 0);
-
-    if (pages == MAP_FAILED) {
-        sem_post(&shared_tree->sem);
-        int errsv = errno;
-        printf("Error:%d\n", errsv);
-        return -1;
+void shared_histogram_read(shared_histogram_t *histogram, fork_tree_histogram_t *out) {
+    for (int i = 0; i < FORK_TREE_STATS_BUCKETS; i++) {
+        out->buckets[i] = atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
     }
+    out->count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+    out->total = atomic_load_explicit(&histogram->total, memory_order_relaxed);
+    out->max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+}
 
-    int inserted = 0;
+/**
+ * Grows the nodes file so it holds the given slot.
+ * The semaphore is only held here, so concurrent forks never wait for each other
+ * unless one of them has to grow the file.
+ */
+int fork_tree_grow_nodes(shared_tree_t *shared_tree, int pages_fd, int slot) {
+    int64_t wait_start = shared_tree->stats_enabled ? fork_tree_now() : 0;
+    sem_wait(&shared_tree->sem);
+    if (shared_tree->stats_enabled) {
+        shared_histogram_add(&shared_tree->lock_wait_stats, fork_tree_now() - wait_start);
+    }
 
-    tree_page_t *last_page = &pages[shared_tree->number_of_pages - 1];
+    int capacity = atomic_load_explicit(&shared_tree->capacity, memory_order_relaxed);
 
-    for (int i = 0; i < NODE_PER_PAGE; i++) {
-        if (last_page->nodes[i] == 0) {
-            last_page->nodes[i] = child_pid;
-            last_page->parent[i] = parent_pid;
-            inserted = 1;
-            msync(last_page, sizeof(tree_page_t) * shared_tree->number_of_pages, MS_SYNC);
-            break;
+    // Another process may have grown the file while we were waiting
+    if (capacity <= slot) {
+        long new_capacity = (long)capacity * 2;
+        if (new_capacity < MIN_CAPACITY) {
+            new_capacity = MIN_CAPACITY;
+        }
+        if (new_capacity <= slot) {
+            new_capacity = (long)slot + 1;
+        }
+        if (new_capacity > shared_tree->reserved_nodes) {
+            new_capacity = shared_tree->reserved_nodes;
         }
-    }
 
-    munmap(pages, sizeof(tree_page_t) * shared_tree->number_of_pages);
+        size_t size = fork_tree_round_size(sizeof(tree_node_t) * new_capacity, sysconf(_SC_PAGESIZE));
+        if (size > shared_tree->reserved_size) {
+            size = shared_tree->reserved_size;
+        }
 
-    if (!inserted) {
-        shared_tree->number_of_pages++;
-        if (ftruncate(shared_tree->pages_fd, sizeof(tree_page_t) * shared_tree->number_of_pages) == -1) {
-            printf("Error truncating pages file\n");
+        int64_t grow_start = shared_tree->stats_enabled ? fork_tree_now() : 0;
+        if (ftruncate(pages_fd, shared_tree->nodes_offset + size) == -1) {
+            printf("Error truncating nodes file\n");
             sem_post(&shared_tree->sem);
             return -1;
         }
+        if (shared_tree->stats_enabled) {
+            shared_histogram_add(&shared_tree->grow_stats, fork_tree_now() - grow_start);
+        }
+        atomic_store_explicit(&shared_tree->capacity, size / sizeof(tree_node_t), memory_order_release);
+    }
+
+    sem_post(&shared_tree->sem);
+    return 0;
+}
 
-        tree_page_t *pages = mmap(
-            NULL,
-            sizeof(tree_page_t) * shared_tree->number_of_pages,
-            PROT_READ | PROT_WRITE, MAP_SHARED,
-            shared_tree->pages_fd,
-            0);
+/**
+ * Claims a new segment of slots for the calling process.
+ * This is the only place where forking processes touch the shared cursor.
+ */
+int fork_tree_claim_segment(fork_tree_t *tree, pid_t owner) {
+    shared_tree_t *shared_tree = fork_tree_get_shared_tree(tree);
 
-        if (pages == MAP_FAILED) {
-            printf("Error mapping last page\n");
-            sem_post(&shared_tree->sem);
+    // The segment inherited from the parent belongs to the parent
+    int size = FIRST_SEGMENT_SIZE;
+    if (tree->segment_owner == owner && tree->segment_size < MAX_SEGMENT_SIZE) {
+        size = tree->segment_size * 2;
+    } else if (tree->segment_owner == owner) {
+        size = MAX_SEGMENT_SIZE;
+    }
+
+    // The cursor is only moved while the tree has room, so it never grows past the reservation
+    int start = atomic_load_explicit(&shared_tree->next_slot, memory_order_relaxed);
+    do {
+        if (start >= shared_tree->reserved_nodes) {
+            if (atomic_exchange_explicit(&shared_tree->full, 1, memory_order_relaxed) == 0) {
+                fprintf(stderr, "Error tree is full, the following forks are not recorded\n");
+            }
             return -1;
         }
-        tree_page_t *last_page = &pages[shared_tree->number_of_pages - 1];
+    } while (!atomic_compare_exchange_weak_explicit(&shared_tree->next_slot, &start, start + size, memory_order_relaxed, memory_order_relaxed));
 
-        last_page->nodes[0] = child_pid;
-        last_page->parent[0] = parent_pid;
+    int end = start + size;
+    if (end > shared_tree->reserved_nodes) {
+        end = shared_tree->reserved_nodes;
+    }
 
-        msync(pages, sizeof(tree_page_t) * shared_tree->number_of_pages, MS_SYNC);
-        munmap(pages, sizeof(tree_page_t) * shared_tree->number_of_pages);
+    if (end > atomic_load_explicit(&shared_tree->capacity, memory_order_acquire)) {
+        if (fork_tree_grow_nodes(shared_tree, tree->pages_fd, end - 1) == -1) {
+            return -1;
+        }
     }
 
-    sem_post(&shared_tree->sem);
+    tree->segment_owner = owner;
+    tree->segment_size = size;
+    tree->segment_next = start;
+    tree->segment_end = end;
     return 0;
 }
 
-int fork_tree_fork(fork_tree_t *tree) {
-    int forked = fork();
-    if (forked != 0) {
-        fork_tree_add_node(tree, getpid(), forked);
-    }
-    return forked;
+void fork_tree_lock(fork_tree_t *tree) {
+    while (atomic_flag_test_and_set_explicit(&tree->lock, memory_order_acquire))
+        ;
 }
 
-int create_circle(FILE *fd, int node, double cx, double cy) {
-    int total = 0;
-    int result = fprintf(fd, "<circle cx=\"%g\" cy=\"%g\" r=\"%g\" fill=\"" CIRCLE_SHADOW_COLOR "\" opacity=\"" CIRCLE_SHADOW_COLOR_OPACITY "\" filter=\"url(#igs-shadow)\"></circle>", cx, cy, (double)(CIRCLE_SIZE) / 2);
-    if (result < 0) {
-        printf("Error writing to file\n");
-        return result;
-    }
-    total += result;
+void fork_tree_unlock(fork_tree_t *tree) {
+    atomic_flag_clear_explicit(&tree->lock, memory_order_release);
+}
 
-    result = fprintf(fd, "<circle cx=\"%g\" cy=\"%g\" r=\"%g\" fill=\"" CIRCLE_COLOR "\"></circle>", cx, cy, (double)(CIRCLE_SIZE) / 2);
-    if (result < 0) {
-        printf("Error writing to file\n");
-        return result;
+/**
+ * Claims the next slot of the segment of parent_pid, returns -1 if the tree is full.
+ * Threads of the same process share the segment, the lock keeps them from claiming the same slot.
+ */
+int fork_tree_claim_slot(fork_tree_t *tree, pid_t parent_pid) {
+    if (fork_tree_get_shared_tree(tree) == NULL) {
+        printf("Error getting shared tree\n");
+        return -1;
     }
-    total += result;
 
-    result = fprintf(fd, "<text font-family=\"-apple-system,system-ui,BlinkMacSystemFont,'Segoe UI',Roboto,'Helvetica Neue',Arial,sans-serif\" x=\"%g\" y=\"%g\" text-anchor=\"middle\" dominant-baseline=\"middle\" fill=\"" TEXT_COLOR "\">%d</text>", cx, cy, node);
-    if (result < 0) {
-        printf("Error writing to file\n");
-        return result;
+    fork_tree_lock(tree);
+    int slot = -1;
+    if ((tree->segment_owner == parent_pid && tree->segment_next < tree->segment_end) || fork_tree_claim_segment(tree, parent_pid) == 0) {
+        slot = tree->segment_next++;
     }
-    total += result;
-    return total;
+    fork_tree_unlock(tree);
+    return slot;
 }
 
-int create_line(FILE *fd, double parent_x, double parent_y, double child_x, double child_y, int is_last_child) {
-    double mid_y = (parent_y + child_y) / 2;
-    double start_y = parent_y + (double)(CIRCLE_SIZE) / 2;
-    double end_y = child_y - (double)(CIRCLE_SIZE) / 2;
-    int total = 0;
-    int result = fprintf(fd, "<path d=\"M%g,%g C%g,%g %g,%g %g,%g\" stroke=\"" LINE_COLOR "\" stroke-width=\"2\" fill=\"none\"></path>", parent_x, start_y, parent_x, mid_y, child_x, mid_y, child_x, end_y);
-    if (result < 0) {
-        printf("Error writing line\n");
-        return result;
-    }
-    total += result;
+void fork_tree_publish_node(fork_tree_t *tree, int slot, pid_t parent_pid, pid_t child_pid, int64_t fork_time) {
+    tree_node_t *node = &tree->nodes[slot];
+    node->pid = child_pid;
+    node->parent = parent_pid;
+    node->fork_time = fork_time;
+    atomic_store_explicit(&node->published, 1, memory_order_release);
+}
 
-    result = fprintf(fd, "<circle cx=\"%g\" cy=\"%g\" r=\"5\" fill=\"" CONNECTOR_COLOR "\"></circle>", child_x, end_y);
-    if (result < 0) {
-        printf("Error writing line\n");
-        return result;
+/**
+ * Records a fork made by any process at fork_time, returns the slot of the record or -1 if the tree is full.
+ */
+int fork_tree_add_node(fork_tree_t *tree, pid_t parent_pid, pid_t child_pid, int64_t fork_time) {
+    shared_tree_t *shared_tree = fork_tree_get_shared_tree(tree);
+    int64_t start = shared_tree != NULL && shared_tree->stats_enabled ? fork_tree_now() : 0;
+
+    // Segments belong to the process writing the record, which is not the parent when recording for others
+    int slot = fork_tree_claim_slot(tree, getpid());
+    if (slot == -1) {
+        return -1;
     }
-    total += result;
 
-    if (is_last_child) {
-        result = fprintf(fd, "<circle cx=\"%g\" cy=\"%g\" r=\"5\" fill=\"" CONNECTOR_COLOR "\"></circle>", parent_x, start_y);
-        if (result < 0) {
-            printf("Error writing line\n");
-            return result;
-        }
+    fork_tree_publish_node(tree, slot, parent_pid, child_pid, fork_time);
+    if (shared_tree->stats_enabled) {
+        shared_histogram_add(&shared_tree->record_stats, fork_tree_now() - start);
     }
-    total += result;
+    return slot;
+}
 
-    return total;
+uint32_t child_slots_hash(child_slots_t *child_slots, pid_t pid) {
+    return ((uint32_t)pid * 2654435769u) >> (32 - child_slots->table_bits);
 }
 
-double get_width(map_node_t **width_map, map_node_t *child_map, int node, int is_dense) {
-    if (map_get(*width_map, node) != NULL) {
-        double *size = map_get(*width_map, node);
-        return *size;
+void child_slots_destroy(fork_tree_t *tree) {
+    if (tree->child_slots != NULL) {
+        free(tree->child_slots->pids);
+        free(tree->child_slots);
+        tree->child_slots = NULL;
     }
+}
 
-    linked_list_t *children = map_get(child_map, node);
-    if (children == NULL) {
-        return (double)(CIRCLE_SIZE);
+/**
+ * Returns the slot of the record of child_pid, -1 if it was not forked by this process.
+ */
+int child_slots_get(fork_tree_t *tree, pid_t child_pid) {
+    child_slots_t *child_slots = tree->child_slots;
+    if (child_slots == NULL) {
+        return -1;
     }
 
-    double max_size = 0;
-    double total_size = 0;
-    linked_list_node_t *current = children->head;
-    while (current != NULL) {
-        int *child = current->value;
-        double size = get_width(width_map, child_map, *child, is_dense);
-        if (size > max_size) {
-            max_size = size;
+    uint32_t mask = (1u << child_slots->table_bits) - 1;
+    uint32_t entry = child_slots_hash(child_slots, child_pid);
+    while (child_slots->pids[entry] != 0) {
+        if (child_slots->pids[entry] == child_pid) {
+            return child_slots->slots[entry];
         }
-        total_size += size;
-        current = current->next;
+        entry = (entry + 1) & mask;
     }
-    double *size = malloc(sizeof(double));
-    if (size == NULL) {
-        printf("Error allocating size\n");
-        return -1;
+    return -1;
+}
+
+/**
+ * Remembers the slot of child_pid, a reused pid takes the slot of its new record.
+ * The table doubles when it is half full, so probes stay short.
+ */
+int child_slots_put(fork_tree_t *tree, pid_t child_pid, int slot) {
+    child_slots_t *child_slots = tree->child_slots;
+    if (child_slots == NULL || child_slots->size * 2 >= (1 << child_slots->table_bits)) {
+        child_slots_t *grown = malloc(sizeof(child_slots_t));
+        int table_bits = child_slots == NULL ? 6 : child_slots->table_bits + 1;
+        size_t table_size = (size_t)1 << table_bits;
+        pid_t *pids = malloc((sizeof(pid_t) + sizeof(int)) * table_size);
+        if (grown == NULL || pids == NULL) {
+            free(grown);
+            free(pids);
+            return -1;
+        }
+
+        memset(pids, 0, sizeof(pid_t) * table_size);
+        grown->pids = pids;
+        grown->slots = (int *)(pids + table_size);
+        grown->table_bits = table_bits;
+        grown->size = 0;
+        tree->child_slots = grown;
+
+        if (child_slots != NULL) {
+            for (size_t i = 0; i < ((size_t)1 << child_slots->table_bits); i++) {
+                if (child_slots->pids[i] != 0) {
+                    child_slots_put(tree, child_slots->pids[i], child_slots->slots[i]);
+                }
+            }
+            free(child_slots->pids);
+            free(child_slots);
+        }
+        child_slots = grown;
     }
 
-    if (is_dense) {
-        *size = total_size + (double)(CIRCLE_MARGIN_X) * (children->size - 1);
-    } else {
-        *size = max_size * children->size + (double)(CIRCLE_MARGIN_X) * (children->size - 1);
+    uint32_t mask = (1u << child_slots->table_bits) - 1;
+    uint32_t entry = child_slots_hash(child_slots, child_pid);
+    while (child_slots->pids[entry] != 0 && child_slots->pids[entry] != child_pid) {
+        entry = (entry + 1) & mask;
     }
-    if (map_put(width_map, node, size)) {
-        printf("Error putting in width map\n");
-        return -1;
+    if (child_slots->pids[entry] == 0) {
+        child_slots->size++;
     }
-    return *size;
+    child_slots->pids[entry] = child_pid;
+    child_slots->slots[entry] = slot;
+    return 0;
 }
 
-int render_tree(FILE *fd, map_node_t **width_map, map_node_t *child_map, canvas_region_t *canvas_region, int node, int level, double base_x, int is_line, int is_dense) {
-    linked_list_t *children = map_get(child_map, node);
-    if (children == NULL) {
-        return 0;
-    }
-
-    double size = get_width(width_map, child_map, node, is_dense);
+int fork_tree_record_fork(fork_tree_t *tree, pid_t parent_pid, pid_t child_pid) {
+    return fork_tree_record_fork_at(tree, parent_pid, child_pid, fork_tree_now());
+}
 
-    double step = 0;
-    if (!is_dense) {
-        step = size / children->size;
+int fork_tree_record_fork_at(fork_tree_t *tree, pid_t parent_pid, pid_t child_pid, int64_t fork_time) {
+    if (child_pid <= 0) {
+        return -1;
     }
 
-    double offset_x = base_x - size / 2 - step / 2;
+    int slot = fork_tree_add_node(tree, parent_pid, child_pid, fork_time);
+    if (slot == -1) {
+        return -1;
+    }
+    // Remembered for fork_tree_record_exit and fork_tree_wait4
+    fork_tree_lock(tree);
+    child_slots_put(tree, child_pid, slot);
+    fork_tree_unlock(tree);
+    return 0;
+}
 
-    int is_root = level == 1;
-    double parent_y = (double)(CIRCLE_SIZE) / 2 + ((double)(CIRCLE_SIZE) + (double)(CIRCLE_MARGIN_Y)) * (level - 1);
-    if (!is_line && is_root) {
-        int result = create_circle(fd, node, base_x, parent_y);
-        if (result < 0) {
-            printf("Error creating circle\n");
-            return result;
+/**
+ * Makes slot the record of the calling process, which was just forked, and forgets the children of its parent.
+ */
+void fork_tree_fork_child(fork_tree_t *tree, int slot) {
+    // Another thread of the parent may have held the lock, it doesn't exist in the child
+    atomic_flag_clear_explicit(&tree->lock, memory_order_relaxed);
+    tree->own_pid = getpid();
+    tree->own_slot = slot;
+    // The children of the parent are not ours to reap
+    child_slots_destroy(tree);
+    if (EXIT_TREE.shared_tree == tree->shared_tree) {
+        EXIT_TREE.own_pid = tree->own_pid;
+        EXIT_TREE.own_slot = slot;
+    }
+}
+
+int fork_tree_prepare_fork(fork_tree_t *tree) {
+    int slot = fork_tree_claim_slot(tree, getpid());
+    // The child may exit before it is published, so the fork time is taken before forking, as fork_tree_fork does
+    if (slot != -1) {
+        tree->nodes[slot].fork_time = fork_tree_now();
+    }
+    return slot;
+}
+
+void fork_tree_finish_fork(fork_tree_t *tree, int slot, pid_t child_pid) {
+    if (child_pid == 0) {
+        fork_tree_fork_child(tree, slot);
+    } else if (child_pid > 0 && slot != -1) {
+        // The slot was claimed from the segment of the calling process, its owner is the parent
+        fork_tree_publish_node(tree, slot, tree->segment_owner, child_pid, tree->nodes[slot].fork_time);
+        fork_tree_lock(tree);
+        child_slots_put(tree, child_pid, slot);
+        fork_tree_unlock(tree);
+    }
+}
+
+/**
+ * The slot of the child is claimed before forking, so the child knows where to write its exit time.
+ */
+int fork_tree_fork(fork_tree_t *tree) {
+    shared_tree_t *shared_tree = fork_tree_get_shared_tree(tree);
+    int stats_enabled = shared_tree != NULL && shared_tree->stats_enabled;
+    int64_t start = stats_enabled ? fork_tree_now() : 0;
+
+    pid_t parent_pid = getpid();
+    int slot = fork_tree_claim_slot(tree, parent_pid);
+    int64_t fork_time = fork_tree_now();
+
+    int forked = fork();
+    int64_t forked_time = stats_enabled && forked != 0 ? fork_tree_now() : 0;
+    if (forked == 0) {
+        fork_tree_fork_child(tree, slot);
+    } else if (forked > 0 && slot != -1) {
+        // When fork fails the claimed slot is left unpublished, readers skip it
+        fork_tree_publish_node(tree, slot, parent_pid, forked, fork_time);
+        fork_tree_lock(tree);
+        child_slots_put(tree, forked, slot);
+        fork_tree_unlock(tree);
+    }
+
+    // Only the parent measures, the time fork() takes is left out
+    if (stats_enabled && forked != 0) {
+        shared_histogram_add(&shared_tree->record_stats, (fork_time - start) + (fork_tree_now() - forked_time));
+    }
+    return forked;
+}
+
+/**
+ * Waits like wait4 and stores the resource usage of the reaped child in its record.
+ * If the child did not record its exit, the time it is reaped is used instead.
+ * Children stopped or continued, with WUNTRACED or WCONTINUED, are not reaped and keep their record unchanged.
+ */
+pid_t fork_tree_wait4(fork_tree_t *tree, pid_t pid, int *status, int options, struct rusage *rusage) {
+    int child_status;
+    struct rusage child_rusage;
+    pid_t reaped = wait4(pid, &child_status, options, &child_rusage);
+    // Like wait4, the buffers of the caller are left untouched when no child changed state
+    if (reaped <= 0) {
+        return reaped;
+    }
+    if (status != NULL) {
+        *status = child_status;
+    }
+    if (rusage != NULL) {
+        *rusage = child_rusage;
+    }
+
+    if (!(WIFEXITED(child_status) || WIFSIGNALED(child_status)) || fork_tree_get_shared_tree(tree) == NULL) {
+        return reaped;
+    }
+
+    fork_tree_lock(tree);
+    int slot = child_slots_get(tree, reaped);
+    fork_tree_unlock(tree);
+    if (slot == -1) {
+        return reaped;
+    }
+
+    tree_node_t *node = &tree->nodes[slot];
+    node->usage.user_time = (int64_t)child_rusage.ru_utime.tv_sec * 1000000 + child_rusage.ru_utime.tv_usec;
+    node->usage.system_time = (int64_t)child_rusage.ru_stime.tv_sec * 1000000 + child_rusage.ru_stime.tv_usec;
+    node->usage.max_rss = child_rusage.ru_maxrss;
+    node->usage.voluntary_switches = child_rusage.ru_nvcsw;
+    node->usage.involuntary_switches = child_rusage.ru_nivcsw;
+    atomic_store_explicit(&node->reaped, 1, memory_order_release);
+
+    int64_t expected = 0;
+    atomic_compare_exchange_strong_explicit(&node->exit_time, &expected, fork_tree_now(), memory_order_release, memory_order_relaxed);
+    return reaped;
+}
+
+/**
+ * Records the exit time of the calling process, only the first call of each process counts.
+ * Processes that were not forked with fork_tree_fork have no record to write it into.
+ */
+void fork_tree_exit(fork_tree_t *tree) {
+    shared_tree_t *shared_tree = fork_tree_get_shared_tree(tree);
+    if (shared_tree == NULL || tree->own_pid != getpid()) {
+        return;
+    }
+
+    _Atomic int64_t *exit_time = NULL;
+    if (tree->own_pid == shared_tree->root_process_id) {
+        exit_time = &shared_tree->root_exit_time;
+    } else if (tree->own_slot != -1) {
+        exit_time = &tree->nodes[tree->own_slot].exit_time;
+    } else {
+        return;
+    }
+
+    int64_t expected = 0;
+    atomic_compare_exchange_strong_explicit(exit_time, &expected, fork_tree_now(), memory_order_release, memory_order_relaxed);
+}
+
+int fork_tree_record_exit(fork_tree_t *tree, pid_t pid) {
+    return fork_tree_record_exit_at(tree, pid, fork_tree_now());
+}
+
+int fork_tree_record_exit_at(fork_tree_t *tree, pid_t pid, int64_t exit_time) {
+    shared_tree_t *shared_tree = fork_tree_get_shared_tree(tree);
+    if (shared_tree == NULL) {
+        return -1;
+    }
+
+    _Atomic int64_t *recorded_exit_time;
+    if (pid == shared_tree->root_process_id) {
+        recorded_exit_time = &shared_tree->root_exit_time;
+    } else {
+        fork_tree_lock(tree);
+        int slot = child_slots_get(tree, pid);
+        fork_tree_unlock(tree);
+        if (slot == -1) {
+            return -1;
+        }
+        recorded_exit_time = &tree->nodes[slot].exit_time;
+    }
+
+    int64_t expected = 0;
+    atomic_compare_exchange_strong_explicit(recorded_exit_time, &expected, exit_time, memory_order_release, memory_order_relaxed);
+    return 0;
+}
+
+void fork_tree_at_exit(void) {
+    fork_tree_exit(&EXIT_TREE);
+}
+
+int fork_tree_get_stats(fork_tree_t *tree, fork_tree_stats_t *stats) {
+    shared_tree_t *shared_tree = fork_tree_get_shared_tree(tree);
+    if (shared_tree == NULL || !shared_tree->stats_enabled) {
+        printf("Error tree was initialized without FORK_TREE_STATS\n");
+        return -1;
+    }
+
+    shared_histogram_read(&shared_tree->record_stats, &stats->record);
+    shared_histogram_read(&shared_tree->lock_wait_stats, &stats->lock_wait);
+    shared_histogram_read(&shared_tree->grow_stats, &stats->grow);
+    return 0;
+}
+
+typedef struct SvgEmitter {
+    // NULL for emitters that keep everything in memory, their buffer grows instead of being flushed
+    FILE *file;
+    // Descriptor of file, -1 if it has none and the buffer is flushed with fwrite
+    int fd;
+    char *buffer;
+    size_t size;
+    size_t capacity;
+    int error;
+    // Bitwise OR of FORK_TREE_SVG_* flags
+    int flags;
+    // Radius of the circles, formatted once since every node repeats it
+    char radius[32];
+    size_t radius_length;
+} svg_emitter_t;
+
+// Writes a string literal without measuring it
+#define svg_emitter_literal(emitter, literal) svg_emitter_write(emitter, literal, sizeof(literal) - 1)
+
+/**
+ * Formats value in base 10, out must have room for 21 characters.
+ * Returns the number of characters written.
+ */
+size_t format_integer(char *out, long long value) {
+    size_t length = 0;
+    unsigned long long magnitude = value;
+    if (value < 0) {
+        out[length++] = '-';
+        magnitude = -(unsigned long long)value;
+    }
+
+    char digits[20];
+    int number_of_digits = 0;
+    do {
+        digits[number_of_digits++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude > 0);
+
+    while (number_of_digits > 0) {
+        out[length++] = digits[--number_of_digits];
+    }
+    return length;
+}
+
+/**
+ * Formats value with at most two decimals, trailing zeros are dropped.
+ * out must have room for 32 characters, returns the number of characters written.
+ */
+size_t format_number(char *out, double value) {
+    // Values too big for fixed point are rare enough to go through snprintf
+    if (value >= 1e15 || value <= -1e15 || value != value) {
+        return snprintf(out, 32, "%g", value);
+    }
+
+    long long scaled = (long long)(value * 100 + (value < 0 ? -0.5 : 0.5));
+    size_t length = 0;
+
+    // Values that round to zero are written without a sign
+    if (scaled < 0) {
+        out[length++] = '-';
+        scaled = -scaled;
+    }
+
+    length += format_integer(out + length, scaled / 100);
+
+    int fraction = scaled % 100;
+    if (fraction != 0) {
+        out[length++] = '.';
+        out[length++] = '0' + fraction / 10;
+        if (fraction % 10 != 0) {
+            out[length++] = '0' + fraction % 10;
+        }
+    }
+    return length;
+}
+
+/**
+ * Creates an emitter that writes to file.
+ * The file is flushed first, then the emitter writes to its descriptor directly until it is destroyed.
+ */
+int svg_emitter_create(svg_emitter_t *emitter, FILE *file, int flags) {
+    if (fflush(file) == EOF) {
+        return -1;
+    }
+
+    emitter->file = file;
+    emitter->fd = fileno(file);
+    emitter->size = 0;
+    emitter->capacity = EMITTER_BUFFER_SIZE;
+    emitter->error = 0;
+    emitter->flags = flags;
+    emitter->buffer = malloc(EMITTER_BUFFER_SIZE);
+    if (emitter->buffer == NULL) {
+        return -1;
+    }
+
+    emitter->radius_length = format_number(emitter->radius, (double)(CIRCLE_SIZE) / 2);
+    return 0;
+}
+
+/**
+ * Creates an emitter that keeps the SVG in memory, to be appended to another emitter.
+ */
+int svg_emitter_create_in_memory(svg_emitter_t *emitter, int flags) {
+    emitter->file = NULL;
+    emitter->fd = -1;
+    emitter->size = 0;
+    emitter->capacity = EMITTER_CHUNK_BUFFER_SIZE;
+    emitter->error = 0;
+    emitter->flags = flags;
+    emitter->buffer = malloc(EMITTER_CHUNK_BUFFER_SIZE);
+    if (emitter->buffer == NULL) {
+        return -1;
+    }
+
+    emitter->radius_length = format_number(emitter->radius, (double)(CIRCLE_SIZE) / 2);
+    return 0;
+}
+
+/**
+ * Writes data to the file of emitter, bypassing its buffer.
+ */
+void svg_emitter_write_out(svg_emitter_t *emitter, const char *data, size_t size) {
+    size_t written = 0;
+    while (written < size && !emitter->error) {
+        if (emitter->fd == -1) {
+            if (fwrite(data + written, 1, size - written, emitter->file) != size - written) {
+                emitter->error = 1;
+            }
+            written = size;
+            continue;
+        }
+
+        ssize_t result = write(emitter->fd, data + written, size - written);
+        if (result == -1 && errno != EINTR) {
+            emitter->error = 1;
+        } else if (result > 0) {
+            written += result;
+        }
+    }
+}
+
+/**
+ * Empties the buffer, into the file, or into a buffer twice as big for emitters in memory.
+ */
+int svg_emitter_flush(svg_emitter_t *emitter) {
+    if (emitter->file == NULL) {
+        char *buffer = realloc(emitter->buffer, emitter->capacity * 2);
+        if (buffer == NULL) {
+            printf("Error allocating memory\n");
+            // Drops what was formatted so the emitter can go on, the error is reported when it is appended
+            emitter->error = 1;
+            emitter->size = 0;
+            return -1;
+        }
+        emitter->buffer = buffer;
+        emitter->capacity *= 2;
+        return 0;
+    }
+
+    svg_emitter_write_out(emitter, emitter->buffer, emitter->size);
+
+    emitter->size = 0;
+    if (emitter->error) {
+        printf("Error writing to file\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Appends what the in memory emitter chunk holds to emitter and empties chunk.
+ * Big chunks are written out directly instead of being copied into the buffer of emitter.
+ */
+void svg_emitter_append(svg_emitter_t *emitter, svg_emitter_t *chunk) {
+    if (chunk->error) {
+        emitter->error = 1;
+    } else if (emitter->size + chunk->size <= emitter->capacity) {
+        memcpy(emitter->buffer + emitter->size, chunk->buffer, chunk->size);
+        emitter->size += chunk->size;
+    } else {
+        svg_emitter_flush(emitter);
+        svg_emitter_write_out(emitter, chunk->buffer, chunk->size);
+    }
+    chunk->size = 0;
+}
+
+/**
+ * Flushes and frees the emitter, returns -1 if anything failed to be written.
+ */
+int svg_emitter_destroy(svg_emitter_t *emitter) {
+    int result = 0;
+    if (emitter->file != NULL) {
+        result = svg_emitter_flush(emitter);
+    } else if (emitter->error) {
+        result = -1;
+    }
+    free(emitter->buffer);
+    return result;
+}
+
+void svg_emitter_write(svg_emitter_t *emitter, const char *data, size_t length) {
+    while (length > 0) {
+        if (emitter->size == emitter->capacity) {
+            svg_emitter_flush(emitter);
+        }
+
+        size_t chunk = emitter->capacity - emitter->size;
+        if (chunk > length) {
+            chunk = length;
+        }
+        memcpy(emitter->buffer + emitter->size, data, chunk);
+        emitter->size += chunk;
+        data += chunk;
+        length -= chunk;
+    }
+}
+
+void svg_emitter_number(svg_emitter_t *emitter, double value) {
+    if (emitter->size + 32 > emitter->capacity) {
+        svg_emitter_flush(emitter);
+    }
+    emitter->size += format_number(emitter->buffer + emitter->size, value);
+}
+
+void svg_emitter_int(svg_emitter_t *emitter, long long value) {
+    if (emitter->size + 32 > emitter->capacity) {
+        svg_emitter_flush(emitter);
+    }
+    emitter->size += format_integer(emitter->buffer + emitter->size, value);
+}
+
+int create_circle(svg_emitter_t *emitter, int node, double cx, double cy) {
+    // The compact header defines the shadow and the circle as #n and the text style as .t
+    if (emitter->flags & FORK_TREE_SVG_COMPACT) {
+        svg_emitter_literal(emitter, "<use xlink:href=\"#n\" x=\"");
+        svg_emitter_number(emitter, cx);
+        svg_emitter_literal(emitter, "\" y=\"");
+        svg_emitter_number(emitter, cy);
+        svg_emitter_literal(emitter, "\"/><text class=\"t\" x=\"");
+        svg_emitter_number(emitter, cx);
+        svg_emitter_literal(emitter, "\" y=\"");
+        svg_emitter_number(emitter, cy);
+        svg_emitter_literal(emitter, "\">");
+        svg_emitter_int(emitter, node);
+        svg_emitter_literal(emitter, "</text>");
+        return emitter->error ? -1 : 0;
+    }
+
+    svg_emitter_literal(emitter, "<circle cx=\"");
+    svg_emitter_number(emitter, cx);
+    svg_emitter_literal(emitter, "\" cy=\"");
+    svg_emitter_number(emitter, cy);
+    svg_emitter_literal(emitter, "\" r=\"");
+    svg_emitter_write(emitter, emitter->radius, emitter->radius_length);
+    svg_emitter_literal(emitter, "\" fill=\"" CIRCLE_SHADOW_COLOR "\" opacity=\"" CIRCLE_SHADOW_COLOR_OPACITY "\" filter=\"url(#igs-shadow)\"></circle>");
+
+    svg_emitter_literal(emitter, "<circle cx=\"");
+    svg_emitter_number(emitter, cx);
+    svg_emitter_literal(emitter, "\" cy=\"");
+    svg_emitter_number(emitter, cy);
+    svg_emitter_literal(emitter, "\" r=\"");
+    svg_emitter_write(emitter, emitter->radius, emitter->radius_length);
+    svg_emitter_literal(emitter, "\" fill=\"" CIRCLE_COLOR "\"></circle>");
+
+    svg_emitter_literal(emitter, "<text font-family=\"" TEXT_FONT_FAMILY "\" x=\"");
+    svg_emitter_number(emitter, cx);
+    svg_emitter_literal(emitter, "\" y=\"");
+    svg_emitter_number(emitter, cy);
+    svg_emitter_literal(emitter, "\" text-anchor=\"middle\" dominant-baseline=\"middle\" fill=\"" TEXT_COLOR "\">");
+    svg_emitter_int(emitter, node);
+    svg_emitter_literal(emitter, "</text>");
+
+    return emitter->error ? -1 : 0;
+}
+
+int create_line(svg_emitter_t *emitter, double parent_x, double parent_y, double child_x, double child_y, int is_last_child) {
+    double mid_y = (parent_y + child_y) / 2;
+    double start_y = parent_y + (double)(CIRCLE_SIZE) / 2;
+    double end_y = child_y - (double)(CIRCLE_SIZE) / 2;
+
+    // The compact header draws the connectors as markers of the .l and .e classes,
+    // and the curve is relative so it only repeats the horizontal distance
+    if (emitter->flags & FORK_TREE_SVG_COMPACT) {
+        if (is_last_child) {
+            svg_emitter_literal(emitter, "<path class=\"l e\" d=\"M");
+        } else {
+            svg_emitter_literal(emitter, "<path class=\"l\" d=\"M");
+        }
+        svg_emitter_number(emitter, parent_x);
+        svg_emitter_literal(emitter, ",");
+        svg_emitter_number(emitter, start_y);
+        svg_emitter_literal(emitter, "c0,");
+        svg_emitter_number(emitter, mid_y - start_y);
+        svg_emitter_literal(emitter, " ");
+        svg_emitter_number(emitter, child_x - parent_x);
+        svg_emitter_literal(emitter, ",");
+        svg_emitter_number(emitter, mid_y - start_y);
+        svg_emitter_literal(emitter, " ");
+        svg_emitter_number(emitter, child_x - parent_x);
+        svg_emitter_literal(emitter, ",");
+        svg_emitter_number(emitter, end_y - start_y);
+        svg_emitter_literal(emitter, "\"/>");
+        return emitter->error ? -1 : 0;
+    }
+
+    svg_emitter_literal(emitter, "<path d=\"M");
+    svg_emitter_number(emitter, parent_x);
+    svg_emitter_literal(emitter, ",");
+    svg_emitter_number(emitter, start_y);
+    svg_emitter_literal(emitter, " C");
+    svg_emitter_number(emitter, parent_x);
+    svg_emitter_literal(emitter, ",");
+    svg_emitter_number(emitter, mid_y);
+    svg_emitter_literal(emitter, " ");
+    svg_emitter_number(emitter, child_x);
+    svg_emitter_literal(emitter, ",");
+    svg_emitter_number(emitter, mid_y);
+    svg_emitter_literal(emitter, " ");
+    svg_emitter_number(emitter, child_x);
+    svg_emitter_literal(emitter, ",");
+    svg_emitter_number(emitter, end_y);
+    svg_emitter_literal(emitter, "\" stroke=\"" LINE_COLOR "\" stroke-width=\"2\" fill=\"none\"></path>");
+
+    svg_emitter_literal(emitter, "<circle cx=\"");
+    svg_emitter_number(emitter, child_x);
+    svg_emitter_literal(emitter, "\" cy=\"");
+    svg_emitter_number(emitter, end_y);
+    svg_emitter_literal(emitter, "\" r=\"5\" fill=\"" CONNECTOR_COLOR "\"></circle>");
+
+    if (is_last_child) {
+        svg_emitter_literal(emitter, "<circle cx=\"");
+        svg_emitter_number(emitter, parent_x);
+        svg_emitter_literal(emitter, "\" cy=\"");
+        svg_emitter_number(emitter, start_y);
+        svg_emitter_literal(emitter, "\" r=\"5\" fill=\"" CONNECTOR_COLOR "\"></circle>");
+    }
+
+    return emitter->error ? -1 : 0;
+}
+
+typedef struct ParallelWorker {
+    struct ParallelRun *run;
+    pthread_t thread;
+    int started;
+    // Tasks left to this worker, the first in the low half and the end in the high half
+    // The worker takes them from the front, idle workers steal them from the back
+    _Atomic uint64_t tasks;
+} parallel_worker_t;
+
+typedef struct ParallelRun {
+    void (*task)(void *context, int task);
+    void *context;
+    parallel_worker_t *workers;
+    int number_of_workers;
+} parallel_run_t;
+
+/**
+ * Takes a task of worker, from the front for its owner and from the back for thieves.
+ * Returns -1 once the worker has no task left.
+ */
+int parallel_worker_take(parallel_worker_t *worker, int from_back) {
+    uint64_t tasks = atomic_load_explicit(&worker->tasks, memory_order_relaxed);
+    while (1) {
+        uint32_t first = (uint32_t)tasks;
+        uint32_t end = (uint32_t)(tasks >> 32);
+        if (first >= end) {
+            return -1;
+        }
+
+        uint64_t left = from_back ? ((uint64_t)(end - 1) << 32) | first : ((uint64_t)end << 32) | (first + 1);
+        if (atomic_compare_exchange_weak_explicit(&worker->tasks, &tasks, left, memory_order_relaxed, memory_order_relaxed)) {
+            return from_back ? (int)(end - 1) : (int)first;
+        }
+    }
+}
+
+void *parallel_worker_main(void *argument) {
+    parallel_worker_t *worker = argument;
+    parallel_run_t *run = worker->run;
+    int index = worker - run->workers;
+
+    int task;
+    while ((task = parallel_worker_take(worker, 0)) != -1) {
+        run->task(run->context, task);
+    }
+
+    // Steals from the other workers until every task is taken
+    for (int i = 1; i < run->number_of_workers; i++) {
+        parallel_worker_t *victim = &run->workers[(index + i) % run->number_of_workers];
+        while ((task = parallel_worker_take(victim, 1)) != -1) {
+            run->task(run->context, task);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Runs task(context, i) for every i below number_of_tasks on up to number_of_threads threads, the calling one included.
+ * Each thread starts with a contiguous block of the tasks and steals from the others once its block is done.
+ * Tasks of a thread that can't be started are stolen by the others, so every task always runs.
+ */
+void parallel_run(void (*task)(void *context, int task), void *context, int number_of_tasks, int number_of_threads) {
+    if (number_of_threads > number_of_tasks) {
+        number_of_threads = number_of_tasks;
+    }
+
+    parallel_worker_t *workers = NULL;
+    if (number_of_threads > 1) {
+        workers = malloc(sizeof(parallel_worker_t) * number_of_threads);
+    }
+    if (workers == NULL) {
+        for (int i = 0; i < number_of_tasks; i++) {
+            task(context, i);
+        }
+        return;
+    }
+
+    parallel_run_t run;
+    run.task = task;
+    run.context = context;
+    run.workers = workers;
+    run.number_of_workers = number_of_threads;
+
+    for (int i = 0; i < number_of_threads; i++) {
+        uint64_t first = (uint64_t)number_of_tasks * i / number_of_threads;
+        uint64_t end = (uint64_t)number_of_tasks * (i + 1) / number_of_threads;
+        workers[i].run = &run;
+        workers[i].started = 0;
+        atomic_init(&workers[i].tasks, (end << 32) | first);
+    }
+
+    for (int i = 1; i < number_of_threads; i++) {
+        workers[i].started = pthread_create(&workers[i].thread, NULL, parallel_worker_main, &workers[i]) == 0;
+    }
+    parallel_worker_main(&workers[0]);
+
+    for (int i = 1; i < number_of_threads; i++) {
+        if (workers[i].started) {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+    free(workers);
+}
+
+typedef struct Fold {
+    // Number of consecutive siblings with the shape of the node, from its pid to last_pid
+    int count;
+    pid_t last_pid;
+    // Number of descendants not drawn because their shape is drawn elsewhere, 0 if the node is expanded
+    int hidden;
+    // Number of the shape of the node in the labels, the same for its drawn subtree and the roots that repeat it,
+    // 0 for leaves and for subtrees found once
+    int shape;
+    // Number of subtrees with that shape in the whole tree
+    int copies;
+} fold_t;
+
+typedef struct TreeRender {
+    // Single index of every node in the render, the arrays below are indexed by it
+    node_index_t index;
+    // Parent of each node, -1 for the root and for nodes whose parent was not recorded
+    int *parents;
+    // Children of node i are children[first_child[i]] to children[first_child[i + 1] - 1]
+    int *first_child;
+    int *children;
+    // Nodes reachable from the root, every node comes before its descendants
+    int *preorder;
+    int number_of_visited;
+    // Number of nodes in the subtree of each node, the subtree of preorder[k] is preorder[k] to preorder[k + size - 1]
+    int *sizes;
+    // CLOCK_MONOTONIC nanoseconds of the fork and the exit of each node, 0 if it has not exited
+    int64_t *fork_times;
+    int64_t *exit_times;
+    // Span of the recorded times
+    int64_t start_time;
+    int64_t end_time;
+    // Resource usage of each node, only meaningful where reaped is nonzero
+    process_usage_t *usages;
+    char *reaped;
+    // Largest value of the metric the nodes are colored by, set before each render
+    double heat_max;
+    // Layout of each node, depth 0 is the root
+    int *depths;
+    double *widths;
+    double *xs;
+    // Shape of each visited node, equal for nodes whose subtrees are the same up to the pids,
+    // NULL until the first folded render
+    int *shapes;
+    int number_of_shapes;
+    // What each node of a folded render stands for, NULL unless the render was folded from another one
+    fold_t *folds;
+} tree_render_t;
+
+void tree_render_destroy(tree_render_t *render);
+
+int tree_render_create(tree_render_t *render, int capacity) {
+    if (node_index_create(&render->index, capacity) == -1) {
+        return -1;
+    }
+
+    render->parents = malloc(sizeof(int) * capacity);
+    render->first_child = malloc(sizeof(int) * (capacity + 1));
+    render->children = malloc(sizeof(int) * capacity);
+    render->preorder = malloc(sizeof(int) * capacity);
+    render->fork_times = malloc(sizeof(int64_t) * capacity);
+    render->exit_times = malloc(sizeof(int64_t) * capacity);
+    render->usages = malloc(sizeof(process_usage_t) * capacity);
+    render->reaped = malloc(sizeof(char) * capacity);
+    render->depths = malloc(sizeof(int) * capacity);
+    render->sizes = malloc(sizeof(int) * capacity);
+    render->widths = malloc(sizeof(double) * capacity);
+    render->xs = malloc(sizeof(double) * capacity);
+    render->shapes = NULL;
+    render->number_of_shapes = 0;
+    render->folds = NULL;
+    render->number_of_visited = 0;
+    if (render->parents == NULL || render->first_child == NULL || render->children == NULL || render->preorder == NULL || render->fork_times == NULL || render->exit_times == NULL || render->usages == NULL || render->reaped == NULL || render->depths == NULL || render->sizes == NULL || render->widths == NULL || render->xs == NULL) {
+        tree_render_destroy(render);
+        return -1;
+    }
+
+    for (int i = 0; i < capacity; i++) {
+        render->parents[i] = -1;
+    }
+    return 0;
+}
+
+void tree_render_destroy(tree_render_t *render) {
+    free(render->parents);
+    free(render->first_child);
+    free(render->children);
+    free(render->preorder);
+    free(render->fork_times);
+    free(render->exit_times);
+    free(render->usages);
+    free(render->reaped);
+    free(render->depths);
+    free(render->sizes);
+    free(render->widths);
+    free(render->xs);
+    free(render->shapes);
+    free(render->folds);
+    node_index_destroy(&render->index);
+}
+
+/**
+ * Builds the compressed sparse rows of the children from the parents.
+ * order holds the nodes that have a parent in the order they were recorded, so siblings keep their fork order.
+ */
+void tree_render_build_children(tree_render_t *render, int *order, int number_of_children) {
+    int number_of_nodes = render->index.size;
+    int *first_child = render->first_child;
+
+    // Counts the children of every node, shifted by one so the prefix sum gives the first child
+    memset(first_child, 0, sizeof(int) * (number_of_nodes + 1));
+    for (int i = 0; i < number_of_nodes; i++) {
+        if (render->parents[i] != -1) {
+            first_child[render->parents[i] + 1]++;
+        }
+    }
+
+    for (int i = 0; i < number_of_nodes; i++) {
+        first_child[i + 1] += first_child[i];
+    }
+
+    // Fills the children using the start of each node as a cursor, which leaves it at the start of the next node
+    for (int i = 0; i < number_of_children; i++) {
+        int parent = render->parents[order[i]];
+        render->children[first_child[parent]++] = order[i];
+    }
+
+    for (int i = number_of_nodes; i > 0; i--) {
+        first_child[i] = first_child[i - 1];
+    }
+    first_child[0] = 0;
+}
+
+/**
+ * Lists the nodes reachable from root in preorder and computes their depths and the sizes of their subtrees.
+ * Uses the end of the preorder array as the work stack, so deep trees never overflow the call stack.
+ */
+void tree_render_build_preorder(tree_render_t *render, int root) {
+    int *preorder = render->preorder;
+    int *stack = render->preorder + render->index.size;
+    int stack_size = 0;
+    int number_of_visited = 0;
+
+    render->depths[root] = 0;
+    stack[-++stack_size] = root;
+
+    // The stack grows down from the end of the array, it never overlaps the visited nodes
+    // since every node is either visited or on the stack
+    while (stack_size > 0) {
+        int node = stack[-stack_size--];
+        preorder[number_of_visited++] = node;
+
+        // Pushes the children in reverse, so the first child is visited first
+        for (int i = render->first_child[node + 1] - 1; i >= render->first_child[node]; i--) {
+            int child = render->children[i];
+            render->depths[child] = render->depths[node] + 1;
+            stack[-++stack_size] = child;
+        }
+    }
+
+    render->number_of_visited = number_of_visited;
+
+    for (int k = number_of_visited - 1; k >= 0; k--) {
+        int node = preorder[k];
+        render->sizes[node] = 1;
+        for (int i = render->first_child[node]; i < render->first_child[node + 1]; i++) {
+            render->sizes[node] += render->sizes[render->children[i]];
+        }
+    }
+}
+
+/**
+ * Numbers the shapes of the subtrees of the visited nodes, hash-consing them from the leaves up:
+ * a shape is the number of children and the shapes of the children in fork order,
+ * so two nodes share a shape when their subtrees only differ by their pids.
+ */
+int tree_render_build_shapes(tree_render_t *render) {
+    int number_of_visited = render->number_of_visited;
+    int table_bits = 4;
+    while ((1L << table_bits) < (long)number_of_visited * 2) {
+        table_bits++;
+    }
+    uint32_t mask = (1u << table_bits) - 1;
+
+    // Open addressing table of shapes, -1 marks an empty slot, with a node of each shape to compare with
+    int *shapes = malloc(sizeof(int) * render->index.size);
+    int *table = malloc(sizeof(int) * ((size_t)mask + 1));
+    int *representatives = malloc(sizeof(int) * number_of_visited);
+    if (shapes == NULL || table == NULL || representatives == NULL) {
+        free(shapes);
+        free(table);
+        free(representatives);
+        return -1;
+    }
+    memset(table, -1, sizeof(int) * ((size_t)mask + 1));
+
+    int number_of_shapes = 0;
+    // Children come after their parent in preorder, so their shapes are known first
+    for (int k = number_of_visited - 1; k >= 0; k--) {
+        int node = render->preorder[k];
+        int first = render->first_child[node];
+        int number_of_children = render->first_child[node + 1] - first;
+
+        uint64_t hash = (uint64_t)number_of_children;
+        for (int i = 0; i < number_of_children; i++) {
+            hash = (hash ^ (uint64_t)shapes[render->children[first + i]]) * 0x9E3779B97F4A7C15ull;
+        }
+
+        uint32_t slot = (uint32_t)(hash >> 32) & mask;
+        while (table[slot] != -1) {
+            int other = representatives[table[slot]];
+            int other_first = render->first_child[other];
+            if (render->first_child[other + 1] - other_first == number_of_children) {
+                int i = 0;
+                while (i < number_of_children && shapes[render->children[first + i]] == shapes[render->children[other_first + i]]) {
+                    i++;
+                }
+                if (i == number_of_children) {
+                    break;
+                }
+            }
+            slot = (slot + 1) & mask;
+        }
+
+        if (table[slot] == -1) {
+            table[slot] = number_of_shapes;
+            representatives[number_of_shapes++] = node;
+        }
+        shapes[node] = table[slot];
+    }
+
+    free(table);
+    free(representatives);
+    render->shapes = shapes;
+    render->number_of_shapes = number_of_shapes;
+    return 0;
+}
+
+/**
+ * Computes the width of the subtree of node from the widths of its children.
+ */
+void tree_render_box_width(tree_render_t *render, int node, int is_dense) {
+    int first = render->first_child[node];
+    int number_of_children = render->first_child[node + 1] - first;
+    if (number_of_children == 0) {
+        render->widths[node] = (double)(CIRCLE_SIZE);
+        return;
+    }
+
+    double max_size = 0;
+    double total_size = 0;
+    for (int i = first; i < first + number_of_children; i++) {
+        double size = render->widths[render->children[i]];
+        if (size > max_size) {
+            max_size = size;
+        }
+        total_size += size;
+    }
+
+    if (is_dense) {
+        render->widths[node] = total_size + (double)(CIRCLE_MARGIN_X) * (number_of_children - 1);
+    } else {
+        render->widths[node] = max_size * number_of_children + (double)(CIRCLE_MARGIN_X) * (number_of_children - 1);
+    }
+}
+
+/**
+ * Places the children of node in the box of its subtree, centered under node.
+ */
+void tree_render_box_place_children(tree_render_t *render, int node, int is_dense) {
+    int first = render->first_child[node];
+    int number_of_children = render->first_child[node + 1] - first;
+    if (number_of_children == 0) {
+        return;
+    }
+
+    double size = render->widths[node];
+    double step = 0;
+    if (!is_dense) {
+        step = size / number_of_children;
+    }
+
+    double offset_x = render->xs[node] - size / 2 - step / 2;
+    for (int i = 0; i < number_of_children; i++) {
+        int child = render->children[first + i];
+        if (is_dense) {
+            render->xs[child] = offset_x + render->widths[child] / 2;
+            offset_x += render->widths[child] + (double)(CIRCLE_MARGIN_X);
+        } else {
+            render->xs[child] = offset_x + step * (i + 1);
+        }
+    }
+}
+
+typedef struct TidyLayout {
+    // Position relative to the parent, and offset applied to the whole subtree
+    double *prelim;
+    double *mod;
+    // Pending moves of the subtrees, spread over the siblings by execute_shifts
+    double *shift;
+    double *change;
+    // Next node of the contour for leaves, -1 if none
+    int *thread;
+    int *ancestor;
+    // Index of each node among its siblings
+    int *number;
+    // prelim of the root, subtracted so the root stays at x = 0
+    double root_prelim;
+} tidy_layout_t;
+
+int tidy_next_left(tree_render_t *render, tidy_layout_t *tidy, int node) {
+    if (render->first_child[node + 1] > render->first_child[node]) {
+        return render->children[render->first_child[node]];
+    }
+    return tidy->thread[node];
+}
+
+int tidy_next_right(tree_render_t *render, tidy_layout_t *tidy, int node) {
+    if (render->first_child[node + 1] > render->first_child[node]) {
+        return render->children[render->first_child[node + 1] - 1];
+    }
+    return tidy->thread[node];
+}
+
+void tidy_move_subtree(tidy_layout_t *tidy, int left, int right, double shift) {
+    double subtrees = tidy->number[right] - tidy->number[left];
+    tidy->change[right] -= shift / subtrees;
+    tidy->shift[right] += shift;
+    tidy->change[left] += shift / subtrees;
+    tidy->prelim[right] += shift;
+    tidy->mod[right] += shift;
+}
+
+/**
+ * Pushes the subtree of node right of the subtrees of its left siblings, walking their facing contours.
+ * Returns the new default ancestor.
+ */
+int tidy_apportion(tree_render_t *render, tidy_layout_t *tidy, int node, int default_ancestor) {
+    int parent = render->parents[node];
+    int first = render->first_child[parent];
+    int number = tidy->number[node];
+    if (number == 0) {
+        return default_ancestor;
+    }
+
+    double distance = (double)(CIRCLE_SIZE) + (double)(CIRCLE_MARGIN_X);
+
+    // Inner and outer contours of the right (node) and the left (siblings) subtrees
+    int inner_right = node;
+    int outer_right = node;
+    int inner_left = render->children[first + number - 1];
+    int outer_left = render->children[first];
+    double inner_right_mod = tidy->mod[inner_right];
+    double outer_right_mod = tidy->mod[outer_right];
+    double inner_left_mod = tidy->mod[inner_left];
+    double outer_left_mod = tidy->mod[outer_left];
+
+    while (tidy_next_right(render, tidy, inner_left) != -1 && tidy_next_left(render, tidy, inner_right) != -1) {
+        inner_left = tidy_next_right(render, tidy, inner_left);
+        inner_right = tidy_next_left(render, tidy, inner_right);
+        outer_left = tidy_next_left(render, tidy, outer_left);
+        outer_right = tidy_next_right(render, tidy, outer_right);
+        tidy->ancestor[outer_right] = node;
+
+        double shift = (tidy->prelim[inner_left] + inner_left_mod) - (tidy->prelim[inner_right] + inner_right_mod) + distance;
+        if (shift > 0) {
+            int ancestor = tidy->ancestor[inner_left];
+            if (render->parents[ancestor] != parent) {
+                ancestor = default_ancestor;
+            }
+            tidy_move_subtree(tidy, ancestor, node, shift);
+            inner_right_mod += shift;
+            outer_right_mod += shift;
+        }
+
+        inner_left_mod += tidy->mod[inner_left];
+        inner_right_mod += tidy->mod[inner_right];
+        outer_left_mod += tidy->mod[outer_left];
+        outer_right_mod += tidy->mod[outer_right];
+    }
+
+    // Threads the shorter contour to the longer one, so later siblings can keep walking it
+    if (tidy_next_right(render, tidy, inner_left) != -1 && tidy_next_right(render, tidy, outer_right) == -1) {
+        tidy->thread[outer_right] = tidy_next_right(render, tidy, inner_left);
+        tidy->mod[outer_right] += inner_left_mod - outer_right_mod;
+    }
+
+    if (tidy_next_left(render, tidy, inner_right) != -1 && tidy_next_left(render, tidy, outer_left) == -1) {
+        tidy->thread[outer_left] = tidy_next_left(render, tidy, inner_right);
+        tidy->mod[outer_left] += inner_right_mod - outer_left_mod;
+        default_ancestor = node;
+    }
+
+    return default_ancestor;
+}
+
+void tidy_execute_shifts(tree_render_t *render, tidy_layout_t *tidy, int node) {
+    double shift = 0;
+    double change = 0;
+    for (int i = render->first_child[node + 1] - 1; i >= render->first_child[node]; i--) {
+        int child = render->children[i];
+        tidy->prelim[child] += shift;
+        tidy->mod[child] += shift;
+        change += tidy->change[child];
+        shift += tidy->shift[child] + change;
+    }
+}
+
+/**
+ * The tidy layout is the linear time tidy tree algorithm of Walker, as improved by Buchheim et al.
+ * Subtrees are placed as close as their contours allow and parents are centered over their children.
+ *
+ * First walk of the tidy layout at node, once the subtrees of its children are done:
+ * places the children left to right, pushing each one away from its left siblings, and centers them under node.
+ * The midpoint of the children is kept in xs until the second walk.
+ */
+void tidy_first_walk(tree_render_t *render, tidy_layout_t *tidy, int node) {
+    double distance = (double)(CIRCLE_SIZE) + (double)(CIRCLE_MARGIN_X);
+    double *midpoints = render->xs;
+
+    // Nothing below node reads its fields before it is reached, so every node initializes its own
+    tidy->prelim[node] = 0;
+    tidy->mod[node] = 0;
+    tidy->shift[node] = 0;
+    tidy->change[node] = 0;
+    tidy->thread[node] = -1;
+    tidy->ancestor[node] = node;
+
+    int first = render->first_child[node];
+    int last = render->first_child[node + 1] - 1;
+    if (last < first) {
+        return;
+    }
+
+    for (int i = first; i <= last; i++) {
+        tidy->number[render->children[i]] = i - first;
+    }
+
+    int default_ancestor = render->children[first];
+    for (int i = first; i <= last; i++) {
+        int child = render->children[i];
+        int is_leaf = render->first_child[child + 1] == render->first_child[child];
+
+        if (i == first) {
+            tidy->prelim[child] = is_leaf ? 0 : midpoints[child];
+        } else {
+            tidy->prelim[child] = tidy->prelim[render->children[i - 1]] + distance;
+            if (!is_leaf) {
+                tidy->mod[child] = tidy->prelim[child] - midpoints[child];
+            }
+        }
+
+        default_ancestor = tidy_apportion(render, tidy, child, default_ancestor);
+    }
+
+    tidy_execute_shifts(render, tidy, node);
+    midpoints[node] = (tidy->prelim[render->children[first]] + tidy->prelim[render->children[last]]) / 2;
+}
+
+/**
+ * Second walk of the tidy layout at node, once its parent is done: adds up the mods of the ancestors.
+ * shift is reused for the sum of the mods of the ancestors of each node.
+ */
+void tidy_second_walk(tree_render_t *render, tidy_layout_t *tidy, int node) {
+    double *ancestors_mod = tidy->shift;
+    render->xs[node] = tidy->prelim[node] + ancestors_mod[node] - tidy->root_prelim;
+    for (int i = render->first_child[node]; i < render->first_child[node + 1]; i++) {
+        ancestors_mod[render->children[i]] = ancestors_mod[node] + tidy->mod[node];
+    }
+}
+
+typedef struct TreeLayout {
+    tree_render_t *render;
+    int layout;
+    tidy_layout_t tidy;
+    // Nodes above the subtrees, in preorder, they are laid out by the calling thread
+    int *top;
+    int number_of_top;
+    // Runs of whole subtrees, as ranges of the preorder, laid out in parallel
+    int *begins;
+    int *ends;
+    int number_of_ranges;
+} tree_layout_t;
+
+/**
+ * Computes what node needs from its children: the width of its subtree, or its first tidy walk.
+ */
+void tree_layout_up(tree_layout_t *layout, int node) {
+    if (layout->layout == FORK_TREE_LAYOUT_TIDY) {
+        tidy_first_walk(layout->render, &layout->tidy, node);
+    } else {
+        tree_render_box_width(layout->render, node, layout->layout == FORK_TREE_LAYOUT_DENSE);
+    }
+}
+
+/**
+ * Places node, or its children, from the position of its parent.
+ */
+void tree_layout_down(tree_layout_t *layout, int node) {
+    if (layout->layout == FORK_TREE_LAYOUT_TIDY) {
+        tidy_second_walk(layout->render, &layout->tidy, node);
+    } else {
+        tree_render_box_place_children(layout->render, node, layout->layout == FORK_TREE_LAYOUT_DENSE);
+    }
+}
+
+// Runs in reverse preorder, so children are done before their parent
+void tree_layout_up_range(void *context, int range) {
+    tree_layout_t *layout = context;
+    for (int k = layout->ends[range] - 1; k >= layout->begins[range]; k--) {
+        tree_layout_up(layout, layout->render->preorder[k]);
+    }
+}
+
+// Runs in preorder, so the parent is placed before its children
+void tree_layout_down_range(void *context, int range) {
+    tree_layout_t *layout = context;
+    for (int k = layout->begins[range]; k < layout->ends[range]; k++) {
+        tree_layout_down(layout, layout->render->preorder[k]);
+    }
+}
+
+/**
+ * Cuts the tree into runs of subtrees of at most grain nodes, the nodes of bigger subtrees are left on top.
+ * Subtrees are contiguous in the preorder, and so are siblings with their subtrees,
+ * so every run is a range of the preorder that depends on nothing outside of it.
+ */
+int tree_layout_partition(tree_layout_t *layout, int grain) {
+    tree_render_t *render = layout->render;
+    int number_of_visited = render->number_of_visited;
+
+    layout->top = malloc(sizeof(int) * number_of_visited * 3);
+    if (layout->top == NULL) {
+        return -1;
+    }
+    layout->begins = layout->top + number_of_visited;
+    layout->ends = layout->begins + number_of_visited;
+    layout->number_of_top = 0;
+    layout->number_of_ranges = 0;
+
+    int k = 0;
+    while (k < number_of_visited) {
+        int node = render->preorder[k];
+        int size = render->sizes[node];
+        if (size > grain) {
+            layout->top[layout->number_of_top++] = node;
+            k++;
+            continue;
+        }
+
+        // Extends the previous run with the next sibling while it stays under the grain
+        int last = layout->number_of_ranges - 1;
+        if (last >= 0 && layout->ends[last] == k && k + size - layout->begins[last] <= grain) {
+            layout->ends[last] = k + size;
+        } else {
+            layout->begins[layout->number_of_ranges] = k;
+            layout->ends[layout->number_of_ranges++] = k + size;
+        }
+        k += size;
+    }
+    return 0;
+}
+
+/**
+ * Computes the x of every node with the given layout, on up to number_of_threads threads.
+ * The tree is laid out in two passes, one from the leaves up and one from the root down.
+ * Big trees are cut into independent subtrees that both passes run in parallel,
+ * while the nodes above them are done by the calling thread between the two passes.
+ * Returns -1 if the layout needs memory that can not be allocated.
+ */
+int tree_render_layout(tree_render_t *render, int layout_kind, int number_of_threads) {
+    int number_of_visited = render->number_of_visited;
+    int whole_tree[2] = {0, number_of_visited};
+    tree_layout_t layout;
+    layout.render = render;
+    layout.layout = layout_kind;
+    layout.top = NULL;
+
+    double *doubles = NULL;
+    int *ints = NULL;
+    if (layout_kind == FORK_TREE_LAYOUT_TIDY) {
+        int number_of_nodes = render->index.size;
+        doubles = malloc(sizeof(double) * 4 * number_of_nodes);
+        ints = malloc(sizeof(int) * 3 * number_of_nodes);
+        if (doubles == NULL || ints == NULL) {
+            free(doubles);
+            free(ints);
+            return -1;
+        }
+
+        layout.tidy.prelim = doubles;
+        layout.tidy.mod = doubles + number_of_nodes;
+        layout.tidy.shift = doubles + 2 * number_of_nodes;
+        layout.tidy.change = doubles + 3 * number_of_nodes;
+        layout.tidy.thread = ints;
+        layout.tidy.ancestor = ints + number_of_nodes;
+        layout.tidy.number = ints + 2 * number_of_nodes;
+    }
+
+    int grain = number_of_visited / (number_of_threads * PARALLEL_TASKS_PER_THREAD);
+    if (grain < PARALLEL_MIN_GRAIN) {
+        grain = PARALLEL_MIN_GRAIN;
+    }
+    if (number_of_threads > 1 && number_of_visited >= PARALLEL_MIN_NODES && tree_layout_partition(&layout, grain) == 0) {
+        parallel_run(tree_layout_up_range, &layout, layout.number_of_ranges, number_of_threads);
+        for (int i = layout.number_of_top - 1; i >= 0; i--) {
+            tree_layout_up(&layout, layout.top[i]);
+        }
+    } else {
+        // A single run over the whole tree
+        layout.top = NULL;
+        layout.number_of_top = 0;
+        layout.begins = &whole_tree[0];
+        layout.ends = &whole_tree[1];
+        layout.number_of_ranges = 1;
+        tree_layout_up_range(&layout, 0);
+    }
+
+    int root = render->preorder[0];
+    if (layout_kind == FORK_TREE_LAYOUT_TIDY) {
+        int is_leaf = render->first_child[root + 1] == render->first_child[root];
+        layout.tidy.prelim[root] = is_leaf ? 0 : render->xs[root];
+        layout.tidy.root_prelim = layout.tidy.prelim[root];
+        layout.tidy.shift[root] = 0;
+    } else {
+        render->xs[root] = 0;
+    }
+
+    for (int i = 0; i < layout.number_of_top; i++) {
+        tree_layout_down(&layout, layout.top[i]);
+    }
+    if (layout.top != NULL) {
+        parallel_run(tree_layout_down_range, &layout, layout.number_of_ranges, number_of_threads);
+    } else {
+        tree_layout_down_range(&layout, 0);
+    }
+
+    free(layout.top);
+    free(doubles);
+    free(ints);
+    return 0;
+}
+
+double tree_render_y(tree_render_t *render, int node) {
+    return (double)(CIRCLE_SIZE) / 2 + ((double)(CIRCLE_SIZE) + (double)(CIRCLE_MARGIN_Y)) * render->depths[node];
+}
+
+/**
+ * Computes the region covered by the circles from the layout, before anything is written.
+ */
+void tree_render_canvas_region(tree_render_t *render, canvas_region_t *canvas_region) {
+    canvas_region->min_x = INFINITY;
+    canvas_region->max_x = -INFINITY;
+    int max_depth = 0;
+
+    for (int k = 0; k < render->number_of_visited; k++) {
+        int node = render->preorder[k];
+        if (canvas_region->min_x > render->xs[node]) {
+            canvas_region->min_x = render->xs[node];
+        }
+        if (canvas_region->max_x < render->xs[node]) {
+            canvas_region->max_x = render->xs[node];
+        }
+        if (max_depth < render->depths[node]) {
+            max_depth = render->depths[node];
+        }
+    }
+
+    double half_circle_size = (double)(CIRCLE_SIZE) / 2;
+    double max_y = half_circle_size + ((double)(CIRCLE_SIZE) + (double)(CIRCLE_MARGIN_Y)) * max_depth;
+
+    canvas_region->min_x -= half_circle_size;
+    canvas_region->max_x += half_circle_size;
+    canvas_region->min_y = 0;
+    canvas_region->max_y = max_y + half_circle_size;
+}
+
+/**
+ * Writes everything that comes before the tree: the document, the canvas and the definitions.
+ */
+void svg_emit_header(svg_emitter_t *emitter, canvas_region_t *canvas_region) {
+    double canvas_width = canvas_region->max_x - canvas_region->min_x;
+    double canvas_height = canvas_region->max_y - canvas_region->min_y;
+
+    svg_emitter_literal(emitter, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n");
+    if (emitter->flags & FORK_TREE_SVG_COMPACT) {
+        svg_emitter_literal(emitter, "<svg xmlns=\"http://www.w3.org/2000/svg\" xmlns:xlink=\"http://www.w3.org/1999/xlink\" version=\"1.1\" viewBox=\"");
+    } else {
+        svg_emitter_literal(emitter, "<svg xmlns=\"http://www.w3.org/2000/svg\" version=\"1.1\" viewBox=\"");
+    }
+    svg_emitter_number(emitter, canvas_region->min_x);
+    svg_emitter_literal(emitter, " ");
+    svg_emitter_number(emitter, canvas_region->min_y);
+    svg_emitter_literal(emitter, " ");
+    svg_emitter_number(emitter, canvas_width);
+    svg_emitter_literal(emitter, " ");
+    svg_emitter_number(emitter, canvas_height);
+    svg_emitter_literal(emitter, "\">");
+
+    svg_emitter_literal(emitter, "<defs><filter id=\"igs-shadow\"><feGaussianBlur in=\"SourceGraphic\" stdDeviation=\"" CIRCLE_SHADOW_BLUR "\"></feGaussianBlur></filter>");
+    if (emitter->flags & FORK_TREE_SVG_COMPACT) {
+        svg_emitter_literal(emitter, "<style>"
+                                     ".l{stroke:" LINE_COLOR ";stroke-width:2;fill:none;marker-end:url(#k)}"
+                                     ".e{marker-start:url(#k)}"
+                                     ".t{font-family:" TEXT_FONT_FAMILY ";text-anchor:middle;dominant-baseline:middle;fill:" TEXT_COLOR "}"
+                                     "</style>");
+        svg_emitter_literal(emitter, "<g id=\"n\"><circle r=\"");
+        svg_emitter_write(emitter, emitter->radius, emitter->radius_length);
+        svg_emitter_literal(emitter, "\" fill=\"" CIRCLE_SHADOW_COLOR "\" opacity=\"" CIRCLE_SHADOW_COLOR_OPACITY "\" filter=\"url(#igs-shadow)\"/><circle r=\"");
+        svg_emitter_write(emitter, emitter->radius, emitter->radius_length);
+        svg_emitter_literal(emitter, "\" fill=\"" CIRCLE_COLOR "\"/></g>");
+        svg_emitter_literal(emitter, "<marker id=\"k\" markerWidth=\"10\" markerHeight=\"10\" refX=\"5\" refY=\"5\" markerUnits=\"userSpaceOnUse\"><circle cx=\"5\" cy=\"5\" r=\"5\" fill=\"" CONNECTOR_COLOR "\"/></marker>");
+    }
+    svg_emitter_literal(emitter, "</defs>");
+
+    svg_emitter_literal(emitter, "<rect x=\"");
+    svg_emitter_number(emitter, canvas_region->min_x);
+    svg_emitter_literal(emitter, "\" y=\"");
+    svg_emitter_number(emitter, canvas_region->min_y);
+    svg_emitter_literal(emitter, "\" width=\"");
+    svg_emitter_number(emitter, canvas_width);
+    svg_emitter_literal(emitter, "\" height=\"");
+    svg_emitter_number(emitter, canvas_height);
+    svg_emitter_literal(emitter, "\" fill=\"" BACKGROUND_COLOR "\"/>");
+}
+
+/**
+ * Value of the metric chosen by the FORK_TREE_SVG_HEAT_* flags.
+ */
+double process_usage_metric(process_usage_t *usage, int flags) {
+    if (flags & FORK_TREE_SVG_HEAT_CPU) {
+        return (double)(usage->user_time + usage->system_time);
+    }
+    if (flags & FORK_TREE_SVG_HEAT_RSS) {
+        return (double)usage->max_rss;
+    }
+    return (double)usage->voluntary_switches + (double)usage->involuntary_switches;
+}
+
+/**
+ * Writes a node colored from HEAT_COLD_COLOR to HEAT_HOT_COLOR by its share of the largest metric,
+ * and scaled by it with FORK_TREE_SVG_HEAT_SIZE, with its resource usage in a tooltip.
+ */
+int create_heat_circle(svg_emitter_t *emitter, tree_render_t *render, int node, double cx, double cy) {
+    process_usage_t *usage = &render->usages[node];
+    double heat = render->heat_max > 0 ? process_usage_metric(usage, emitter->flags) / render->heat_max : 0;
+
+    double radius = (double)(CIRCLE_SIZE) / 2;
+    if (emitter->flags & FORK_TREE_SVG_HEAT_SIZE) {
+        radius *= HEAT_MIN_SCALE + (1 - HEAT_MIN_SCALE) * heat;
+    }
+
+    int cold = HEAT_COLD_COLOR;
+    int hot = HEAT_HOT_COLOR;
+    char color[8];
+    snprintf(color, sizeof(color), "#%02X%02X%02X",
+             (int)(((cold >> 16) & 0xFF) + (((hot >> 16) & 0xFF) - ((cold >> 16) & 0xFF)) * heat),
+             (int)(((cold >> 8) & 0xFF) + (((hot >> 8) & 0xFF) - ((cold >> 8) & 0xFF)) * heat),
+             (int)((cold & 0xFF) + ((hot & 0xFF) - (cold & 0xFF)) * heat));
+
+    svg_emitter_literal(emitter, "<g><title>PID ");
+    svg_emitter_int(emitter, render->index.pids[node]);
+    svg_emitter_literal(emitter, "\nuser ");
+    svg_emitter_number(emitter, (double)usage->user_time / 1000);
+    svg_emitter_literal(emitter, " ms, system ");
+    svg_emitter_number(emitter, (double)usage->system_time / 1000);
+    svg_emitter_literal(emitter, " ms\nmax RSS ");
+    svg_emitter_int(emitter, usage->max_rss);
+    svg_emitter_literal(emitter, " KB\ncontext switches ");
+    svg_emitter_int(emitter, usage->voluntary_switches);
+    svg_emitter_literal(emitter, " voluntary, ");
+    svg_emitter_int(emitter, usage->involuntary_switches);
+    svg_emitter_literal(emitter, " involuntary</title>");
+
+    if (!(emitter->flags & FORK_TREE_SVG_COMPACT)) {
+        svg_emitter_literal(emitter, "<circle cx=\"");
+        svg_emitter_number(emitter, cx);
+        svg_emitter_literal(emitter, "\" cy=\"");
+        svg_emitter_number(emitter, cy);
+        svg_emitter_literal(emitter, "\" r=\"");
+        svg_emitter_number(emitter, radius);
+        svg_emitter_literal(emitter, "\" fill=\"" CIRCLE_SHADOW_COLOR "\" opacity=\"" CIRCLE_SHADOW_COLOR_OPACITY "\" filter=\"url(#igs-shadow)\"></circle>");
+    }
+
+    svg_emitter_literal(emitter, "<circle cx=\"");
+    svg_emitter_number(emitter, cx);
+    svg_emitter_literal(emitter, "\" cy=\"");
+    svg_emitter_number(emitter, cy);
+    svg_emitter_literal(emitter, "\" r=\"");
+    svg_emitter_number(emitter, radius);
+    svg_emitter_literal(emitter, "\" fill=\"");
+    svg_emitter_write(emitter, color, 7);
+    svg_emitter_literal(emitter, "\"></circle>");
+
+    if (emitter->flags & FORK_TREE_SVG_COMPACT) {
+        svg_emitter_literal(emitter, "<text class=\"t\" x=\"");
+    } else {
+        svg_emitter_literal(emitter, "<text font-family=\"" TEXT_FONT_FAMILY "\" text-anchor=\"middle\" dominant-baseline=\"middle\" fill=\"" TEXT_COLOR "\" x=\"");
+    }
+    svg_emitter_number(emitter, cx);
+    svg_emitter_literal(emitter, "\" y=\"");
+    svg_emitter_number(emitter, cy);
+    svg_emitter_literal(emitter, "\">");
+    svg_emitter_int(emitter, render->index.pids[node]);
+    svg_emitter_literal(emitter, "</text></g>");
+
+    return emitter->error ? -1 : 0;
+}
+
+/**
+ * Writes under a node of a folded render the number of its shape with the number of copies of the shape,
+ * or for a repeated subtree the number of the shape it repeats and its number of hidden descendants, which is also ringed,
+ * then the number of siblings it stands for and their pids.
+ * The labels are outlined with the background color, so the lines they cross don't hide them.
+ */
+int create_fold_label(svg_emitter_t *emitter, tree_render_t *render, int node, double cx, double cy) {
+    fold_t *fold = &render->folds[node];
+    if (fold->shape == 0 && fold->count == 1) {
+        return 0;
+    }
+
+    if (fold->hidden > 0) {
+        svg_emitter_literal(emitter, "<circle cx=\"");
+        svg_emitter_number(emitter, cx);
+        svg_emitter_literal(emitter, "\" cy=\"");
+        svg_emitter_number(emitter, cy);
+        svg_emitter_literal(emitter, "\" r=\"");
+        svg_emitter_number(emitter, (double)(CIRCLE_SIZE) / 2 + 4);
+        svg_emitter_literal(emitter, "\" fill=\"none\" stroke=\"" LINE_COLOR "\" stroke-width=\"2\" stroke-dasharray=\"4 3\"></circle>");
+    }
+
+    svg_emitter_literal(emitter, "<text font-family=\"" TEXT_FONT_FAMILY "\" font-size=\"");
+    svg_emitter_int(emitter, FOLD_TEXT_SIZE);
+    svg_emitter_literal(emitter, "\" text-anchor=\"middle\" fill=\"" FOLD_TEXT_COLOR "\" stroke=\"" BACKGROUND_COLOR "\" stroke-width=\"3\" paint-order=\"stroke\" x=\"");
+    svg_emitter_number(emitter, cx);
+    svg_emitter_literal(emitter, "\" y=\"");
+    svg_emitter_number(emitter, cy + (double)(CIRCLE_SIZE) / 2 + 4 + FOLD_TEXT_SIZE);
+    svg_emitter_literal(emitter, "\">");
+    if (fold->shape != 0) {
+        svg_emitter_literal(emitter, "#");
+        svg_emitter_int(emitter, fold->shape);
+        if (fold->hidden > 0) {
+            svg_emitter_literal(emitter, " +");
+            svg_emitter_int(emitter, fold->hidden);
+        } else {
+            svg_emitter_literal(emitter, ": ");
+            svg_emitter_int(emitter, fold->copies);
+            svg_emitter_literal(emitter, " copies");
+        }
+    }
+    if (fold->count > 1) {
+        if (fold->shape != 0) {
+            svg_emitter_literal(emitter, "<tspan x=\"");
+            svg_emitter_number(emitter, cx);
+            svg_emitter_literal(emitter, "\" dy=\"");
+            svg_emitter_int(emitter, FOLD_TEXT_SIZE + 2);
+            svg_emitter_literal(emitter, "\">");
+        }
+        svg_emitter_literal(emitter, "&#215;");
+        svg_emitter_int(emitter, fold->count);
+        svg_emitter_literal(emitter, " ");
+        svg_emitter_int(emitter, render->index.pids[node]);
+        svg_emitter_literal(emitter, "&#8211;");
+        svg_emitter_int(emitter, fold->last_pid);
+        if (fold->shape != 0) {
+            svg_emitter_literal(emitter, "</tspan>");
+        }
+    }
+    svg_emitter_literal(emitter, "</text>");
+
+    return emitter->error ? -1 : 0;
+}
+
+/**
+ * Writes the lines or the circles of the nodes from preorder[begin] to preorder[end - 1].
+ */
+int render_tree_range(svg_emitter_t *emitter, tree_render_t *render, int is_line, int begin, int end) {
+    for (int k = begin; k < end; k++) {
+        int node = render->preorder[k];
+        double x = render->xs[node];
+        double y = tree_render_y(render, node);
+
+        if (is_line) {
+            // The root has no line to its parent
+            if (k == 0) {
+                continue;
+            }
+
+            int parent = render->parents[node];
+            int is_last_child = render->children[render->first_child[parent + 1] - 1] == node;
+            int result = create_line(emitter, render->xs[parent], tree_render_y(render, parent), x, y, is_last_child);
+            if (result < 0) {
+                printf("Error creating line\n");
+                return result;
+            }
+        } else {
+            int result;
+            if ((emitter->flags & FORK_TREE_SVG_HEAT_METRICS) && render->reaped[node]) {
+                result = create_heat_circle(emitter, render, node, x, y);
+            } else {
+                result = create_circle(emitter, render->index.pids[node], x, y);
+            }
+            if (result == 0 && render->folds != NULL) {
+                result = create_fold_label(emitter, render, node, x, y);
+            }
+            if (result < 0) {
+                printf("Error creating circle\n");
+                return result;
+            }
+        }
+    }
+    return 0;
+}
+
+typedef struct SvgChunks {
+    tree_render_t *render;
+    // One in memory emitter per chunk of the current wave
+    svg_emitter_t *emitters;
+    // Chunks are numbered lines first, then circles, number_of_chunks of each
+    int number_of_chunks;
+    int first_chunk;
+} svg_chunks_t;
+
+void svg_chunks_emit(void *context, int task) {
+    svg_chunks_t *chunks = context;
+    int chunk = chunks->first_chunk + task;
+    int is_line = chunk < chunks->number_of_chunks;
+    int begin = (chunk % chunks->number_of_chunks) * EMITTER_CHUNK_NODES;
+    int end = begin + EMITTER_CHUNK_NODES;
+    if (end > chunks->render->number_of_visited) {
+        end = chunks->render->number_of_visited;
+    }
+
+    render_tree_range(&chunks->emitters[task], chunks->render, is_line, begin, end);
+}
+
+/**
+ * Writes the lines, then the circles, of every node in preorder.
+ * Big trees are cut into chunks of nodes formatted in parallel, each into its own buffer,
+ * and the buffers are appended in order, so the output is the same as with a single thread.
+ * Chunks are done in waves of a few per thread, so only a wave is ever held in memory.
+ */
+int render_tree(svg_emitter_t *emitter, tree_render_t *render, int number_of_threads) {
+    int number_of_visited = render->number_of_visited;
+    if (number_of_threads <= 1 || number_of_visited < PARALLEL_MIN_NODES) {
+        if (render_tree_range(emitter, render, 1, 0, number_of_visited) == -1) {
+            printf("Error rendering tree lines\n");
+            return -1;
+        }
+        if (render_tree_range(emitter, render, 0, 0, number_of_visited) == -1) {
+            printf("Error rendering tree circle\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    svg_chunks_t chunks;
+    chunks.render = render;
+    chunks.number_of_chunks = (number_of_visited + EMITTER_CHUNK_NODES - 1) / EMITTER_CHUNK_NODES;
+
+    int wave_size = number_of_threads * EMITTER_CHUNKS_PER_THREAD;
+    chunks.emitters = malloc(sizeof(svg_emitter_t) * wave_size);
+    if (chunks.emitters == NULL) {
+        printf("Error allocating memory\n");
+        return -1;
+    }
+
+    int number_of_emitters = 0;
+    while (number_of_emitters < wave_size && svg_emitter_create_in_memory(&chunks.emitters[number_of_emitters], emitter->flags) == 0) {
+        number_of_emitters++;
+    }
+
+    int result = 0;
+    if (number_of_emitters < wave_size) {
+        printf("Error allocating memory\n");
+        result = -1;
+    }
+
+    for (int chunk = 0; chunk < chunks.number_of_chunks * 2 && result == 0; chunk += wave_size) {
+        int number_of_tasks = chunks.number_of_chunks * 2 - chunk;
+        if (number_of_tasks > wave_size) {
+            number_of_tasks = wave_size;
+        }
+
+        chunks.first_chunk = chunk;
+        parallel_run(svg_chunks_emit, &chunks, number_of_tasks, number_of_threads);
+
+        for (int i = 0; i < number_of_tasks; i++) {
+            svg_emitter_append(emitter, &chunks.emitters[i]);
+        }
+        if (emitter->error) {
+            printf("Error rendering tree\n");
+            result = -1;
+        }
+    }
+
+    for (int i = 0; i < number_of_emitters; i++) {
+        svg_emitter_destroy(&chunks.emitters[i]);
+    }
+    free(chunks.emitters);
+    return result;
+}
+
+typedef struct SnapshotBuilder {
+    tree_render_t *render;
+    // Nodes that got a parent, in the order they were added, so siblings keep their fork order
+    int *order;
+    int number_of_children;
+    int root;
+} snapshot_builder_t;
+
+/**
+ * Prepares a snapshot of up to number_of_records forks under root_process_id, started at start_time.
+ */
+int snapshot_builder_create(snapshot_builder_t *builder, pid_t root_process_id, int number_of_records, int64_t start_time, int64_t root_exit_time) {
+    builder->render = malloc(sizeof(tree_render_t));
+    builder->order = malloc(sizeof(int) * number_of_records);
+    builder->number_of_children = 0;
+    // Every node has one parent, so there are at most twice as many pids as nodes, plus the root
+    if (builder->render == NULL || builder->order == NULL || tree_render_create(builder->render, number_of_records * 2 + 1) == -1) {
+        printf("Error allocating memory\n");
+        free(builder->render);
+        free(builder->order);
+        return -1;
+    }
+
+    builder->root = node_index_put(&builder->render->index, root_process_id);
+    builder->render->fork_times[builder->root] = start_time;
+    builder->render->exit_times[builder->root] = root_exit_time;
+    builder->render->reaped[builder->root] = 0;
+    builder->render->start_time = start_time;
+    builder->render->end_time = start_time > root_exit_time ? start_time : root_exit_time;
+    return 0;
+}
+
+/**
+ * Adds the fork of child_pid by parent_pid, usage is NULL if the child was not reaped with fork_tree_wait4.
+ */
+void snapshot_builder_add(snapshot_builder_t *builder, pid_t parent_pid, pid_t child_pid, int64_t fork_time, int64_t exit_time, const process_usage_t *usage) {
+    tree_render_t *render = builder->render;
+    int parent = node_index_put(&render->index, parent_pid);
+    int child = node_index_put(&render->index, child_pid);
+
+    // A reused pid keeps its first parent, and the root never becomes a child
+    if (child == builder->root || render->parents[child] != -1) {
+        return;
+    }
+    render->parents[child] = parent;
+    render->fork_times[child] = fork_time;
+    render->exit_times[child] = exit_time;
+    render->reaped[child] = usage != NULL;
+    if (usage != NULL) {
+        render->usages[child] = *usage;
+    }
+    if (render->end_time < fork_time) {
+        render->end_time = fork_time;
+    }
+    if (render->end_time < exit_time) {
+        render->end_time = exit_time;
+    }
+    builder->order[builder->number_of_children++] = child;
+}
+
+/**
+ * Builds the children and the preorder of the added forks into snapshot.
+ */
+void snapshot_builder_finish(snapshot_builder_t *builder, fork_tree_snapshot_t *snapshot) {
+    tree_render_t *render = builder->render;
+
+    tree_render_build_children(render, builder->order, builder->number_of_children);
+    free(builder->order);
+
+    tree_render_build_preorder(render, builder->root);
+
+    snapshot->render = render;
+    snapshot->number_of_processes = render->number_of_visited;
+    for (int k = 0; k < render->number_of_visited; k++) {
+        if (snapshot->depth < render->depths[render->preorder[k]]) {
+            snapshot->depth = render->depths[render->preorder[k]];
+        }
+    }
+}
+
+void snapshot_builder_destroy(snapshot_builder_t *builder) {
+    tree_render_destroy(builder->render);
+    free(builder->render);
+    free(builder->order);
+}
+
+void fork_tree_snapshot_init(fork_tree_snapshot_t *snapshot) {
+    snapshot->render = NULL;
+    snapshot->number_of_processes = 0;
+    snapshot->depth = 0;
+    snapshot->number_of_threads = 0;
+}
+
+typedef struct FoldEdge {
+    int parent;
+    // First node of a run of consecutive siblings with the same shape
+    int child;
+    int last_child;
+    int count;
+    int hidden;
+} fold_edge_t;
+
+/**
+ * Numbers the shapes of the folded render that are found more than once, in the order they are drawn.
+ * folds[node].shape holds the shape of each node in the whole tree, and is replaced by its number in the labels.
+ */
+void tree_render_number_folds(tree_render_t *folded_render, int number_of_shapes) {
+    int *numbers = calloc(number_of_shapes, sizeof(int));
+    int number_of_numbers = 0;
+
+    for (int k = 0; k < folded_render->number_of_visited; k++) {
+        int node = folded_render->preorder[k];
+        fold_t *fold = &folded_render->folds[node];
+        // Leaves are never labeled, drawn subtrees have children and repeated ones hide them
+        int has_children = folded_render->first_child[node + 1] > folded_render->first_child[node] || fold->hidden > 0;
+        if (numbers == NULL || fold->copies < 2 || !has_children) {
+            fold->shape = 0;
+            continue;
         }
+        if (numbers[fold->shape] == 0) {
+            numbers[fold->shape] = ++number_of_numbers;
+        }
+        fold->shape = numbers[fold->shape];
+    }
+    free(numbers);
+}
+
+/**
+ * Builds into folded the tree of render with every shape drawn once.
+ * Runs of consecutive siblings with the same shape are drawn as their first sibling,
+ * and a node whose shape was already drawn elsewhere is drawn without its descendants.
+ * Shapes found more than once are numbered, with their number of copies in the whole tree.
+ * The folded tree has a node per run of the children of the drawn shapes, whatever the number of processes.
+ */
+int tree_render_fold(tree_render_t *render, fork_tree_snapshot_t *folded) {
+    if (render->shapes == NULL && tree_render_build_shapes(render) == -1) {
+        return -1;
+    }
+
+    int number_of_visited = render->number_of_visited;
+    int root = render->preorder[0];
+    fold_edge_t *edges = malloc(sizeof(fold_edge_t) * number_of_visited);
+    int *stack = malloc(sizeof(int) * number_of_visited);
+    char *expanded = calloc(render->number_of_shapes, sizeof(char));
+    int *copies = calloc(render->number_of_shapes, sizeof(int));
+    if (edges == NULL || stack == NULL || expanded == NULL || copies == NULL) {
+        free(edges);
+        free(stack);
+        free(expanded);
+        free(copies);
+        return -1;
+    }
+
+    for (int k = 0; k < number_of_visited; k++) {
+        copies[render->shapes[render->preorder[k]]]++;
+    }
 
-        double half_circle_size = (double)(CIRCLE_SIZE) / 2;
+    int number_of_edges = 0;
+    int stack_size = 0;
+    expanded[render->shapes[root]] = 1;
+    stack[stack_size++] = root;
 
-        double min_x = base_x - half_circle_size;
-        double max_x = base_x + half_circle_size;
+    while (stack_size > 0) {
+        int node = stack[--stack_size];
+        int end = render->first_child[node + 1];
+        for (int i = render->first_child[node]; i < end;) {
+            int child = render->children[i];
+            int shape = render->shapes[child];
+            int count = 1;
+            while (i + count < end && render->shapes[render->children[i + count]] == shape) {
+                count++;
+            }
 
-        if (canvas_region->min_x > min_x) {
-            canvas_region->min_x = min_x;
+            fold_edge_t *edge = &edges[number_of_edges++];
+            edge->parent = node;
+            edge->child = child;
+            edge->last_child = render->children[i + count - 1];
+            edge->count = count;
+            edge->hidden = 0;
+            if (expanded[shape]) {
+                edge->hidden = render->sizes[child] - 1;
+            } else {
+                expanded[shape] = 1;
+                stack[stack_size++] = child;
+            }
+            i += count;
         }
+    }
+    free(stack);
+    free(expanded);
 
-        if (canvas_region->max_x < max_x) {
-            canvas_region->max_x = max_x;
-        }
+    snapshot_builder_t builder;
+    if (snapshot_builder_create(&builder, render->index.pids[root], number_of_edges, render->fork_times[root], render->exit_times[root]) == -1) {
+        free(edges);
+        free(copies);
+        return -1;
+    }
+    tree_render_t *folded_render = builder.render;
+    folded_render->folds = malloc(sizeof(fold_t) * folded_render->index.capacity);
+    if (folded_render->folds == NULL) {
+        snapshot_builder_destroy(&builder);
+        free(edges);
+        free(copies);
+        return -1;
+    }
 
-        double min_y = parent_y - half_circle_size;
-        double max_y = parent_y + half_circle_size;
+    // The span of the times stays the one of the whole tree
+    folded_render->start_time = render->start_time;
+    folded_render->end_time = render->end_time;
+    folded_render->folds[builder.root].count = 1;
+    folded_render->folds[builder.root].last_pid = render->index.pids[root];
+    folded_render->folds[builder.root].hidden = 0;
+    folded_render->folds[builder.root].shape = render->shapes[root];
+    folded_render->folds[builder.root].copies = copies[render->shapes[root]];
 
-        if (canvas_region->min_y > min_y) {
-            canvas_region->min_y = min_y;
-        }
+    for (int i = 0; i < number_of_edges; i++) {
+        int child = edges[i].child;
+        snapshot_builder_add(&builder, render->index.pids[edges[i].parent], render->index.pids[child], render->fork_times[child], render->exit_times[child], render->reaped[child] ? &render->usages[child] : NULL);
 
-        if (canvas_region->max_y < max_y) {
-            canvas_region->max_y = max_y;
-        }
+        int folded_node = node_index_get(&folded_render->index, render->index.pids[child]);
+        folded_render->folds[folded_node].count = edges[i].count;
+        folded_render->folds[folded_node].last_pid = render->index.pids[edges[i].last_child];
+        folded_render->folds[folded_node].hidden = edges[i].hidden;
+        folded_render->folds[folded_node].shape = render->shapes[child];
+        folded_render->folds[folded_node].copies = copies[render->shapes[child]];
     }
+    free(edges);
+    free(copies);
 
-    double y = (double)(CIRCLE_SIZE) / 2 + ((double)(CIRCLE_SIZE) + (double)(CIRCLE_MARGIN_Y)) * level;
-    linked_list_node_t *current = children->head;
-    int i = 0;
-    while (current != NULL) {
-        int *child = current->value;
-        double child_size = get_width(width_map, child_map, *child, is_dense);
+    snapshot_builder_finish(&builder, folded);
+    tree_render_number_folds(folded_render, render->number_of_shapes);
+    return 0;
+}
 
-        double x;
-        if (is_dense) {
-            x = offset_x + child_size / 2;
-            offset_x += child_size + (double)(CIRCLE_MARGIN_X);
-        } else {
-            x = offset_x + step * (i + 1);
+/**
+ * Number of slots that may hold a published node, slots past the capacity may not be truncated yet.
+ */
+int fork_tree_number_of_slots(shared_tree_t *shared_tree) {
+    int number_of_nodes = atomic_load_explicit(&shared_tree->next_slot, memory_order_acquire);
+    int capacity = atomic_load_explicit(&shared_tree->capacity, memory_order_acquire);
+    if (number_of_nodes > capacity) {
+        number_of_nodes = capacity;
+    }
+    return number_of_nodes;
+}
+
+/**
+ * Builds the snapshot from the first number_of_nodes slots of nodes.
+ */
+int fork_tree_snapshot_read(fork_tree_snapshot_t *snapshot, shared_tree_t *shared_tree, tree_node_t *nodes, int number_of_nodes) {
+    // Segments may hold slots that were never used, the builder is sized by the published records
+    int number_of_records = 0;
+    for (int i = 0; i < number_of_nodes; i++) {
+        if (atomic_load_explicit(&nodes[i].published, memory_order_relaxed)) {
+            number_of_records++;
         }
+    }
 
-        if (is_line) {
-            int result = create_line(fd, base_x, parent_y, x, y, current->next == NULL);
-            if (result < 0) {
-                printf("Error creating line\n");
-                return result;
-            }
-        } else {
-            int result = create_circle(fd, *child, x, y);
-            if (result < 0) {
-                printf("Error creating circle\n");
-                return result;
-            }
+    if (number_of_records == 0) {
+        return 0;
+    }
 
-            double min_x = x - (double)(CIRCLE_SIZE) / 2;
-            double max_x = x + (double)(CIRCLE_SIZE) / 2;
+    snapshot_builder_t builder;
+    int64_t root_exit_time = atomic_load_explicit(&shared_tree->root_exit_time, memory_order_acquire);
+    if (snapshot_builder_create(&builder, shared_tree->root_process_id, number_of_records, shared_tree->start_time, root_exit_time) == -1) {
+        return -1;
+    }
 
-            if (canvas_region->min_x > min_x) {
-                canvas_region->min_x = min_x;
-            }
+    // Records published after the count are left out, as if they were published after the scan
+    for (int i = 0; i < number_of_nodes && number_of_records > 0; i++) {
+        tree_node_t *node = &nodes[i];
+        if (atomic_load_explicit(&node->published, memory_order_acquire)) {
+            number_of_records--;
+            int64_t exit_time = atomic_load_explicit(&node->exit_time, memory_order_acquire);
+            int reaped = atomic_load_explicit(&node->reaped, memory_order_acquire);
+            snapshot_builder_add(&builder, node->parent, node->pid, node->fork_time, exit_time, reaped ? &node->usage : NULL);
+        }
+    }
 
-            if (canvas_region->max_x < max_x) {
-                canvas_region->max_x = max_x;
-            }
+    snapshot_builder_finish(&builder, snapshot);
+    return 0;
+}
 
-            double min_y = y - (double)(CIRCLE_SIZE) / 2;
-            double max_y = y + (double)(CIRCLE_SIZE) / 2;
+/**
+ * Builds the tree from the published nodes: the index of the pids, the children and the preorder.
+ * The snapshot is independent of the shared memory, so it can be rendered any number of times.
+ *
+ * No lock is taken, so the forking processes never wait for a snapshot.
+ * The file only grows and capacity is stored after the file is truncated, so every slot below it is mapped,
+ * and a node is only read once its published flag is set, after its pids were written.
+ * Nodes forked while the scan runs may or may not be in the snapshot.
+ * Processes whose own fork is not published yet can't be reached from the root and are left out with their children.
+ */
+int fork_tree_snapshot_take(fork_tree_t *tree, fork_tree_snapshot_t *snapshot) {
+    shared_tree_t *shared_tree = fork_tree_get_shared_tree(tree);
 
-            if (canvas_region->min_y > min_y) {
-                canvas_region->min_y = min_y;
-            }
+    fork_tree_snapshot_init(snapshot);
 
-            if (canvas_region->max_y < max_y) {
-                canvas_region->max_y = max_y;
-            }
-        }
-        if (render_tree(fd, width_map, child_map, canvas_region, *child, level + 1, x, is_line, is_dense) == -1) {
-            return -1;
-        }
-        i++;
-        current = current->next;
+    if (shared_tree == NULL) {
+        return -1;
+    }
+
+    if (fork_tree_snapshot_read(snapshot, shared_tree, tree->nodes, fork_tree_number_of_slots(shared_tree)) == -1) {
+        return -1;
+    }
+
+    // Processes that are still running last until the snapshot
+    if (snapshot->render != NULL) {
+        snapshot->render->end_time = fork_tree_now();
     }
     return 0;
 }
 
-void width_map_destroy(map_node_t *width_map) {
-    free(width_map->value);
-    if (width_map->left != NULL) {
-        width_map_destroy(width_map->left);
+/**
+ * Maps the file of a tree read only and reads the snapshot straight from the mapping.
+ * The program that recorded the file may have died at any point, so the slots are also bounded by the file size.
+ */
+int fork_tree_snapshot_open(fork_tree_snapshot_t *snapshot, const char *path) {
+    fork_tree_snapshot_init(snapshot);
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        printf("Error opening %s\n", path);
+        return -1;
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1 || (size_t)file_stat.st_size < sizeof(shared_tree_t)) {
+        printf("Error not a fork tree file\n");
+        close(fd);
+        return -1;
     }
-    if (width_map->right != NULL) {
-        width_map_destroy(width_map->right);
+
+    size_t size = file_stat.st_size;
+    char *file = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        printf("Error mapping %s\n", path);
+        return -1;
     }
-}
 
-void child_map_destroy(map_node_t *child_map) {
-    linked_list_t *children = child_map->value;
-    linked_list_node_t *current = children->head;
-    while (current != NULL) {
-        free(current->value);
-        current = current->next;
+    shared_tree_t *shared_tree = (shared_tree_t *)file;
+    if (memcmp(shared_tree->magic, STORE_MAGIC, sizeof(shared_tree->magic)) != 0 || shared_tree->version != STORE_VERSION || shared_tree->nodes_offset < sizeof(shared_tree_t) || shared_tree->nodes_offset > size) {
+        printf("Error not a fork tree file\n");
+        munmap(file, size);
+        return -1;
     }
-    linked_list_destroy(children);
-    free(children);
-    if (child_map->left != NULL) {
-        child_map_destroy(child_map->left);
+
+    int number_of_nodes = fork_tree_number_of_slots(shared_tree);
+    size_t number_of_slots = (size - shared_tree->nodes_offset) / sizeof(tree_node_t);
+    if ((size_t)number_of_nodes > number_of_slots) {
+        number_of_nodes = number_of_slots;
     }
-    if (child_map->right != NULL) {
-        child_map_destroy(child_map->right);
+
+    int result = fork_tree_snapshot_read(snapshot, shared_tree, (tree_node_t *)(file + shared_tree->nodes_offset), number_of_nodes);
+    munmap(file, size);
+    return result;
+}
+
+size_t trace_put_varint(unsigned char *buffer, uint64_t value) {
+    size_t length = 0;
+    while (value >= 0x80) {
+        buffer[length++] = (unsigned char)(value | 0x80);
+        value >>= 7;
     }
+    buffer[length++] = (unsigned char)value;
+    return length;
 }
 
-void fork_tree_render_cleanup(shared_tree_t *shared_tree, map_node_t *child_map, map_node_t *width_map, FILE *fd) {
-    width_map_destroy(width_map);
-    map_destroy(width_map);
-    child_map_destroy(child_map);
-    map_destroy(child_map);
-    fclose(fd);
-    sem_post(&shared_tree->sem);
+// Maps small negative deltas to small varints: 0, -1, 1, -2, 2... become 0, 1, 2, 3, 4...
+uint64_t trace_zigzag(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
 }
 
-int fork_tree_render_centralized_svg(fork_tree_t *tree, FILE *fd) {
+int64_t trace_unzigzag(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+/**
+ * Reads a varint, returns -1 if the file ends or the varint is longer than 64 bits.
+ */
+int trace_get_varint(FILE *file, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = getc(file);
+        if (byte == EOF) {
+            return -1;
+        }
+
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Writes the published forks to file in the trace format:
+ * the magic, the version, then as varints the root pid, the number of forks, the start time,
+ * the time the root lived and the time the trace spans,
+ * then each fork as the zigzag varint deltas of its parent to the previous parent, of its child to the previous child
+ * and of its fork time to the previous fork time, followed by the time the child lived.
+ * Times the process lived are 0 while it runs, and 1 more than the time otherwise.
+ * Then comes 0 if the child was not reaped with fork_tree_wait4, otherwise its user time plus 1,
+ * its system time, its maximum RSS and its voluntary and involuntary context switches.
+ * Children are mostly forked with growing pids and the same parent forks many of them,
+ * so the pids of most forks fit in 2 to 3 bytes.
+ * Like snapshots, exporting takes no lock, nodes forked meanwhile may or may not be exported.
+ * Version 1 traces have no times, version 2 traces have no resource usage.
+ */
+int fork_tree_export(fork_tree_t *tree, FILE *file) {
     shared_tree_t *shared_tree = fork_tree_get_shared_tree(tree);
 
     if (shared_tree == NULL) {
         return -1;
     }
 
-    sem_wait(&shared_tree->sem);
-    if (shared_tree->number_of_pages == 0) {
-        return 0;
+    // The header holds the number of forks, so they are counted first,
+    // and forks published after the count are left out as if they were published after the export
+    int number_of_nodes = fork_tree_number_of_slots(shared_tree);
+    int number_of_records = 0;
+    for (int i = 0; i < number_of_nodes; i++) {
+        if (atomic_load_explicit(&tree->nodes[i].published, memory_order_relaxed)) {
+            number_of_records++;
+        }
     }
 
-    tree_page_t *pages = mmap(NULL, sizeof(tree_page_t) * shared_tree->number_of_pages, PROT_READ, MAP_PRIVATE, shared_tree->pages_fd, 0);
-
-    if (pages == MAP_FAILED) {
-        printf("Error mapping pages\n");
-        sem_post(&shared_tree->sem);
-        return -1;
-    }
-
-    map_node_t *map = NULL;
-    map_node_t *width_map = NULL;
-    FILE *tmp = tmpfile();
-
-    for (int i = 0; i < shared_tree->number_of_pages; i++) {
-        tree_page_t *current_page = &pages[i];
-        for (int j = 0; j < NODE_PER_PAGE; j++) {
-            if (current_page->nodes[j] != 0) {
-                linked_list_t *list = map_get(map, current_page->parent[j]);
-                if (list == NULL) {
-                    list = malloc(sizeof(linked_list_t));
-                    if (list == NULL) {
-                        printf("Error allocating memory\n");
-                        fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
-                        return -1;
-                    }
-                    linked_list_create(list);
-                    if (map_put(&map, current_page->parent[j], list) == -1) {
-                        printf("Error putting in map\n");
-                        fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
-                        return -1;
-                    }
-                }
-                int *value = malloc(sizeof(int));
-                if (value == NULL) {
-                    printf("Error allocating memory\n");
-                    fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
+    unsigned char *buffer = malloc(TRACE_BUFFER_SIZE);
+    if (buffer == NULL) {
+        printf("Error allocating memory\n");
+        return -1;
+    }
 
-                    return -1;
-                }
-                *value = current_page->nodes[j];
-                if (linked_list_add(list, value) == -1) {
-                    printf("Error adding to list\n");
-                    fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
-                    return -1;
+    int64_t root_exit_time = atomic_load_explicit(&shared_tree->root_exit_time, memory_order_acquire);
+    size_t size = sizeof(TRACE_MAGIC) - 1;
+    memcpy(buffer, TRACE_MAGIC, size);
+    buffer[size++] = TRACE_VERSION;
+    size += trace_put_varint(buffer + size, (uint64_t)shared_tree->root_process_id);
+    size += trace_put_varint(buffer + size, (uint64_t)number_of_records);
+    size += trace_put_varint(buffer + size, (uint64_t)shared_tree->start_time);
+    size += trace_put_varint(buffer + size, root_exit_time == 0 ? 0 : (uint64_t)(root_exit_time - shared_tree->start_time) + 1);
+    size += trace_put_varint(buffer + size, (uint64_t)(fork_tree_now() - shared_tree->start_time));
+
+    int result = 0;
+    pid_t previous_parent = shared_tree->root_process_id;
+    pid_t previous_child = shared_tree->root_process_id;
+    int64_t previous_fork_time = shared_tree->start_time;
+    for (int i = 0; i < number_of_nodes && number_of_records > 0; i++) {
+        tree_node_t *node = &tree->nodes[i];
+        if (atomic_load_explicit(&node->published, memory_order_acquire)) {
+            // Writes the buffer when the longest record may not fit in it anymore
+            if (size > TRACE_BUFFER_SIZE - TRACE_MAX_RECORD_SIZE) {
+                if (fwrite(buffer, 1, size, file) != size) {
+                    result = -1;
+                    break;
                 }
+                size = 0;
+            }
+
+            pid_t parent = node->parent;
+            pid_t child = node->pid;
+            int64_t exit_time = atomic_load_explicit(&node->exit_time, memory_order_acquire);
+            size += trace_put_varint(buffer + size, trace_zigzag((int64_t)parent - previous_parent));
+            size += trace_put_varint(buffer + size, trace_zigzag((int64_t)child - previous_child));
+            size += trace_put_varint(buffer + size, trace_zigzag(node->fork_time - previous_fork_time));
+            size += trace_put_varint(buffer + size, exit_time == 0 ? 0 : (uint64_t)(exit_time - node->fork_time) + 1);
+            if (atomic_load_explicit(&node->reaped, memory_order_acquire)) {
+                size += trace_put_varint(buffer + size, (uint64_t)node->usage.user_time + 1);
+                size += trace_put_varint(buffer + size, (uint64_t)node->usage.system_time);
+                size += trace_put_varint(buffer + size, (uint64_t)node->usage.max_rss);
+                size += trace_put_varint(buffer + size, (uint64_t)node->usage.voluntary_switches);
+                size += trace_put_varint(buffer + size, (uint64_t)node->usage.involuntary_switches);
+            } else {
+                buffer[size++] = 0;
             }
+            previous_parent = parent;
+            previous_child = child;
+            previous_fork_time = node->fork_time;
+            number_of_records--;
         }
     }
-    get_width(&width_map, map, shared_tree->root_process_id, 0);
-
-    canvas_region_t canvas_region = {
-        .max_x = -INFINITY,
-        .max_y = -INFINITY,
-        .min_x = INFINITY,
-        .min_y = INFINITY};
 
-    if (render_tree(tmp, &width_map, map, &canvas_region, shared_tree->root_process_id, 1, 0, 1, 0) == -1) {
-        printf("Error rendering tree lines\n");
-        fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
-        return -1;
+    if (result == 0 && fwrite(buffer, 1, size, file) != size) {
+        result = -1;
+    }
+    if (result == -1) {
+        printf("Error writing trace to file\n");
     }
+    free(buffer);
+    return result;
+}
+
+int fork_tree_for_each_record(fork_tree_t *tree, int (*function)(void *context, const fork_tree_record_t *record), void *context) {
+    shared_tree_t *shared_tree = fork_tree_get_shared_tree(tree);
 
-    if (render_tree(tmp, &width_map, map, &canvas_region, shared_tree->root_process_id, 1, 0, 0, 0) == -1) {
-        printf("Error rendering tree circle\n");
-        fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
+    if (shared_tree == NULL) {
         return -1;
     }
 
-    canvas_region.max_x += DOCUMENT_MARGIN;
-    canvas_region.max_y += DOCUMENT_MARGIN;
-    canvas_region.min_x -= DOCUMENT_MARGIN;
-    canvas_region.min_y -= DOCUMENT_MARGIN;
+    int number_of_nodes = fork_tree_number_of_slots(shared_tree);
+    for (int i = 0; i < number_of_nodes; i++) {
+        tree_node_t *node = &tree->nodes[i];
+        if (atomic_load_explicit(&node->published, memory_order_acquire)) {
+            fork_tree_record_t record;
+            record.parent = node->parent;
+            record.child = node->pid;
+            record.fork_time = node->fork_time;
+            record.exit_time = atomic_load_explicit(&node->exit_time, memory_order_acquire);
+            int result = function(context, &record);
+            if (result != 0) {
+                return result;
+            }
+        }
+    }
+    return 0;
+}
 
-    int result = fprintf(fd, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n");
-    if (result < 0) {
-        printf("Error writing xml tag to file\n");
-        fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
-        return -1;
+/**
+ * Reads the rest of a stream into a buffer allocated with malloc, which grows with what is read.
+ */
+int trace_read_stream(FILE *file, char **buffer, size_t *size) {
+    size_t capacity = TRACE_BUFFER_SIZE;
+    *size = 0;
+    *buffer = malloc(capacity);
+    while (*buffer != NULL) {
+        *size += fread(*buffer + *size, 1, capacity - *size, file);
+        if (*size < capacity) {
+            if (ferror(file)) {
+                printf("Error reading trace\n");
+                free(*buffer);
+                return -1;
+            }
+            return 0;
+        }
+        char *grown = realloc(*buffer, capacity * 2);
+        if (grown == NULL) {
+            free(*buffer);
+            *buffer = NULL;
+        } else {
+            *buffer = grown;
+            capacity *= 2;
+        }
     }
+    printf("Error allocating memory\n");
+    return -1;
+}
+
+/**
+ * Decodes the number_of_records records of a trace from input into builder, destroys builder if one is truncated.
+ */
+int trace_decode_records(snapshot_builder_t *builder, FILE *input, uint64_t number_of_records, pid_t root_process_id, int64_t start_time, int has_times, int has_usage) {
+    int64_t parent = (int64_t)root_process_id;
+    int64_t child = (int64_t)root_process_id;
+    int64_t fork_time = start_time;
+    for (uint64_t i = 0; i < number_of_records; i++) {
+        uint64_t parent_delta;
+        uint64_t child_delta;
+        uint64_t fork_time_delta = 0;
+        uint64_t lifetime = 0;
+        if (trace_get_varint(input, &parent_delta) == -1 || trace_get_varint(input, &child_delta) == -1 ||
+            (has_times && (trace_get_varint(input, &fork_time_delta) == -1 || trace_get_varint(input, &lifetime) == -1))) {
+            printf("Error truncated trace\n");
+            snapshot_builder_destroy(builder);
+            return -1;
+        }
 
-    double canvas_width = canvas_region.max_x - canvas_region.min_x;
-    double canvas_height = canvas_region.max_y - canvas_region.min_y;
+        uint64_t user_time = 0;
+        uint64_t values[4];
+        if (has_usage && trace_get_varint(input, &user_time) == -1) {
+            printf("Error truncated trace\n");
+            snapshot_builder_destroy(builder);
+            return -1;
+        }
 
-    result = fprintf(fd, "<svg xmlns=\"http://www.w3.org/2000/svg\" version=\"1.1\" viewBox=\"%g %g %g %g\">", canvas_region.min_x, canvas_region.min_y, canvas_width, canvas_height);
-    if (result < 0) {
-        printf("Error writing svg tag to file\n");
-        fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
-        return -1;
+        process_usage_t usage;
+        if (user_time != 0) {
+            for (int j = 0; j < 4; j++) {
+                if (trace_get_varint(input, &values[j]) == -1) {
+                    printf("Error truncated trace\n");
+                    snapshot_builder_destroy(builder);
+                    return -1;
+                }
+            }
+            usage.user_time = (int64_t)user_time - 1;
+            usage.system_time = (int64_t)values[0];
+            usage.max_rss = (int32_t)values[1];
+            usage.voluntary_switches = (int32_t)values[2];
+            usage.involuntary_switches = (int32_t)values[3];
+        }
+
+        parent += trace_unzigzag(parent_delta);
+        child += trace_unzigzag(child_delta);
+        fork_time += trace_unzigzag(fork_time_delta);
+        snapshot_builder_add(builder, (pid_t)parent, (pid_t)child, fork_time, lifetime == 0 ? 0 : fork_time + (int64_t)lifetime - 1, user_time != 0 ? &usage : NULL);
     }
 
-    result = fprintf(fd, "<defs><filter id=\"igs-shadow\"><feGaussianBlur in=\"SourceGraphic\" stdDeviation=\"" CIRCLE_SHADOW_BLUR "\"></feGaussianBlur></filter></defs>");
-    if (result < 0) {
-        printf("Error writing def tag to file\n");
-        fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
+    return 0;
+}
+
+/**
+ * Reads a trace written by fork_tree_export into snapshot.
+ */
+int fork_tree_snapshot_import(fork_tree_snapshot_t *snapshot, FILE *file) {
+    fork_tree_snapshot_init(snapshot);
+
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+        printf("Error not a fork tree trace\n");
         return -1;
     }
 
-    result = fprintf(fd, "<rect x=\"%g\" y=\"%g\" width=\"%g\" height=\"%g\" fill=\"" BACKGROUND_COLOR "\"/>", canvas_region.min_x, canvas_region.min_y, canvas_width, canvas_height);
-    if (result < 0) {
-        printf("Error writing background tag to file\n");
-        fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
+    int version = getc(file);
+    if (version < 1 || version > TRACE_VERSION) {
+        printf("Error unsupported trace version %d\n", version);
         return -1;
     }
+    int has_times = version >= 2;
+    int has_usage = version >= 3;
 
-    int end_position = ftell(tmp);
-
-    if (end_position == -1) {
-        printf("Error getting position\n");
-        fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
+    uint64_t root_process_id;
+    uint64_t number_of_records;
+    uint64_t start_time = 0;
+    uint64_t root_lifetime = 0;
+    uint64_t span = 0;
+    if (trace_get_varint(file, &root_process_id) == -1 || trace_get_varint(file, &number_of_records) == -1 || number_of_records > INT32_MAX / 2) {
+        printf("Error invalid trace header\n");
         return -1;
     }
-
-    if (fseek(tmp, 0, SEEK_SET) == -1) {
-        printf("Error seeking\n");
-        fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
+    if (has_times && (trace_get_varint(file, &start_time) == -1 || trace_get_varint(file, &root_lifetime) == -1 || trace_get_varint(file, &span) == -1)) {
+        printf("Error invalid trace header\n");
         return -1;
     }
+    if (number_of_records == 0) {
+        return 0;
+    }
 
-    for (int i = 0; i < end_position; i++) {
-        int c = fgetc(tmp);
-        if (c == EOF) {
-            printf("Error reading tmp file\n");
-            fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
+    // Every fork takes at least a byte per varint, so a trace can't hold more forks than its remaining bytes,
+    // whatever its header says, and a corrupted header doesn't allocate more than the input.
+    // Pipes have no size, so their records are read into memory first and decoded from there.
+    FILE *input = file;
+    char *stream = NULL;
+    uint64_t remaining_size;
+    struct stat file_stat;
+    long offset = ftell(file);
+    if (fstat(fileno(file), &file_stat) == 0 && S_ISREG(file_stat.st_mode) && offset != -1) {
+        remaining_size = file_stat.st_size > offset ? (uint64_t)(file_stat.st_size - offset) : 0;
+    } else {
+        size_t stream_size;
+        if (trace_read_stream(file, &stream, &stream_size) == -1) {
             return -1;
         }
-        result = fputc(c, fd);
-        if (result == EOF) {
-            printf("Error writing to file\n");
-            fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
+        remaining_size = stream_size;
+        input = stream_size > 0 ? fmemopen(stream, stream_size, "r") : NULL;
+        if (stream_size > 0 && input == NULL) {
+            printf("Error reading trace\n");
+            free(stream);
             return -1;
         }
     }
+    uint64_t min_record_size = 2 + (has_times ? 2 : 0) + (has_usage ? 1 : 0);
+    if (number_of_records > remaining_size / min_record_size) {
+        printf("Error truncated trace\n");
+        if (input != file && input != NULL) {
+            fclose(input);
+        }
+        free(stream);
+        return -1;
+    }
 
-    result = fprintf(fd, "</svg>");
-    if (result < 0) {
-        printf("Error writing svg tag to file\n");
-        fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
+    snapshot_builder_t builder;
+    int64_t root_exit_time = root_lifetime == 0 ? 0 : (int64_t)(start_time + root_lifetime - 1);
+    int result = snapshot_builder_create(&builder, (pid_t)root_process_id, (int)number_of_records, (int64_t)start_time, root_exit_time);
+    if (result == 0) {
+        result = trace_decode_records(&builder, input, number_of_records, (pid_t)root_process_id, (int64_t)start_time, has_times, has_usage);
+    }
+    if (input != file) {
+        fclose(input);
+    }
+    free(stream);
+    if (result == -1) {
         return -1;
     }
 
-    // document_margin
+    snapshot_builder_finish(&builder, snapshot);
+    // Processes that were still running when the trace was exported last until then
+    if (snapshot->render->end_time < (int64_t)(start_time + span)) {
+        snapshot->render->end_time = (int64_t)(start_time + span);
+    }
+    return 0;
+}
 
-    canvas_region.min_x -= DOCUMENT_MARGIN;
-    canvas_region.min_y -= DOCUMENT_MARGIN;
-    canvas_region.max_x += DOCUMENT_MARGIN;
-    canvas_region.max_y += DOCUMENT_MARGIN;
+/**
+ * Number of threads the snapshot is rendered with, 0 stands for every online core.
+ */
+int fork_tree_snapshot_threads(fork_tree_snapshot_t *snapshot) {
+    if (snapshot->number_of_threads > 0) {
+        return snapshot->number_of_threads;
+    }
 
-    munmap(pages, sizeof(tree_page_t) * shared_tree->number_of_pages);
-    fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
-    return 0;
+    long number_of_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return number_of_cores > 0 ? (int)number_of_cores : 1;
 }
 
-int fork_tree_render_dense_svg(fork_tree_t *tree, FILE *fd) {
-    shared_tree_t *shared_tree = fork_tree_get_shared_tree(tree);
+/**
+ * Lays out the snapshot with the given layout and streams it into fd with the given FORK_TREE_SVG_* flags.
+ * Only the layout is computed again, the tree itself is reused.
+ */
+int fork_tree_snapshot_render_svg(fork_tree_snapshot_t *snapshot, FILE *fd, int layout, int flags) {
+    tree_render_t *render = snapshot->render;
 
-    if (shared_tree == NULL) {
+    if (layout != FORK_TREE_LAYOUT_CENTRALIZED && layout != FORK_TREE_LAYOUT_DENSE && layout != FORK_TREE_LAYOUT_TIDY) {
+        printf("Error unknown layout\n");
         return -1;
     }
 
-    sem_wait(&shared_tree->sem);
-    if (shared_tree->number_of_pages == 0) {
+    // Nothing was forked when the snapshot was taken
+    if (render == NULL) {
         return 0;
     }
 
-    tree_page_t *pages = mmap(NULL, sizeof(tree_page_t) * shared_tree->number_of_pages, PROT_READ, MAP_PRIVATE, shared_tree->pages_fd, 0);
-
-    if (pages == MAP_FAILED) {
-        printf("Error mapping pages\n");
-        sem_post(&shared_tree->sem);
-        return -1;
-    }
-
-    map_node_t *map = NULL;
-    map_node_t *width_map = NULL;
-    FILE *tmp = tmpfile();
-
-    for (int i = 0; i < shared_tree->number_of_pages; i++) {
-        tree_page_t *current_page = &pages[i];
-        for (int j = 0; j < NODE_PER_PAGE; j++) {
-            if (current_page->nodes[j] != 0) {
-                linked_list_t *list = map_get(map, current_page->parent[j]);
-                if (list == NULL) {
-                    list = malloc(sizeof(linked_list_t));
-                    if (list == NULL) {
-                        printf("Error allocating memory\n");
-                        fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
-                        return -1;
-                    }
-                    linked_list_create(list);
-                    if (map_put(&map, current_page->parent[j], list) == -1) {
-                        printf("Error putting in map\n");
-                        fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
-                        return -1;
-                    }
-                }
-                int *value = malloc(sizeof(int));
-                if (value == NULL) {
-                    printf("Error allocating memory\n");
-                    fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
-
-                    return -1;
-                }
-                *value = current_page->nodes[j];
-                if (linked_list_add(list, value) == -1) {
-                    printf("Error adding to list\n");
-                    fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
-                    return -1;
-                }
-            }
+    // The folded tree is laid out and written instead, the whole tree is never laid out
+    if (flags & FORK_TREE_SVG_FOLD) {
+        fork_tree_snapshot_t folded;
+        fork_tree_snapshot_init(&folded);
+        if (tree_render_fold(render, &folded) == -1) {
+            printf("Error allocating memory\n");
+            return -1;
         }
+        folded.number_of_threads = snapshot->number_of_threads;
+        int result = fork_tree_snapshot_render_svg(&folded, fd, layout, flags & ~FORK_TREE_SVG_FOLD);
+        fork_tree_snapshot_free(&folded);
+        return result;
     }
-    get_width(&width_map, map, shared_tree->root_process_id, 1);
-
-    canvas_region_t canvas_region = {
-        .max_x = -INFINITY,
-        .max_y = -INFINITY,
-        .min_x = INFINITY,
-        .min_y = INFINITY};
 
-    if (render_tree(tmp, &width_map, map, &canvas_region, shared_tree->root_process_id, 1, 0, 1, 1) == -1) {
-        printf("Error rendering tree lines\n");
-        fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
+    if (tree_render_layout(render, layout, fork_tree_snapshot_threads(snapshot)) == -1) {
+        printf("Error allocating memory\n");
         return -1;
     }
 
-    if (render_tree(tmp, &width_map, map, &canvas_region, shared_tree->root_process_id, 1, 0, 0, 1) == -1) {
-        printf("Error rendering tree circle\n");
-        fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
-        return -1;
+    render->heat_max = 0;
+    if (flags & FORK_TREE_SVG_HEAT_METRICS) {
+        for (int k = 0; k < render->number_of_visited; k++) {
+            int node = render->preorder[k];
+            if (render->reaped[node] && render->heat_max < process_usage_metric(&render->usages[node], flags)) {
+                render->heat_max = process_usage_metric(&render->usages[node], flags);
+            }
+        }
     }
 
+    canvas_region_t canvas_region;
+    tree_render_canvas_region(render, &canvas_region);
+
     canvas_region.max_x += DOCUMENT_MARGIN;
     canvas_region.max_y += DOCUMENT_MARGIN;
     canvas_region.min_x -= DOCUMENT_MARGIN;
     canvas_region.min_y -= DOCUMENT_MARGIN;
+    if (render->folds != NULL) {
+        canvas_region.max_y += FOLD_LABEL_HEIGHT;
+    }
 
-    int result = fprintf(fd, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n");
-    if (result < 0) {
-        printf("Error writing xml tag to file\n");
-        fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
+    svg_emitter_t emitter;
+    if (svg_emitter_create(&emitter, fd, flags) == -1) {
+        printf("Error creating svg emitter\n");
         return -1;
     }
 
-    double canvas_width = canvas_region.max_x - canvas_region.min_x;
-    double canvas_height = canvas_region.max_y - canvas_region.min_y;
+    svg_emit_header(&emitter, &canvas_region);
 
-    result = fprintf(fd, "<svg xmlns=\"http://www.w3.org/2000/svg\" version=\"1.1\" viewBox=\"%g %g %g %g\">", canvas_region.min_x, canvas_region.min_y, canvas_width, canvas_height);
-    if (result < 0) {
-        printf("Error writing svg tag to file\n");
-        fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
+    if (render_tree(&emitter, render, fork_tree_snapshot_threads(snapshot)) == -1) {
+        svg_emitter_destroy(&emitter);
         return -1;
     }
 
-    result = fprintf(fd, "<defs><filter id=\"igs-shadow\"><feGaussianBlur in=\"SourceGraphic\" stdDeviation=\"" CIRCLE_SHADOW_BLUR "\"></feGaussianBlur></filter></defs>");
-    if (result < 0) {
-        printf("Error writing def tag to file\n");
-        fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
+    svg_emitter_literal(&emitter, "</svg>");
+
+    if (svg_emitter_destroy(&emitter) == -1) {
+        printf("Error writing svg to file\n");
         return -1;
     }
 
-    result = fprintf(fd, "<rect x=\"%g\" y=\"%g\" width=\"%g\" height=\"%g\" fill=\"" BACKGROUND_COLOR "\"/>", canvas_region.min_x, canvas_region.min_y, canvas_width, canvas_height);
-    if (result < 0) {
-        printf("Error writing background tag to file\n");
-        fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
-        return -1;
+    return 0;
+}
+
+void fork_tree_snapshot_free(fork_tree_snapshot_t *snapshot) {
+    if (snapshot->render != NULL) {
+        tree_render_destroy(snapshot->render);
+        free(snapshot->render);
+        snapshot->render = NULL;
     }
+}
+
+double timeline_x(tree_render_t *render, int64_t time) {
+    double span = render->end_time > render->start_time ? (double)(render->end_time - render->start_time) : 1;
+    return (double)(time - render->start_time) / span * (double)(TIMELINE_WIDTH);
+}
+
+double timeline_y(int row) {
+    return (double)(TIMELINE_AXIS_HEIGHT) + (double)(TIMELINE_ROW_HEIGHT) * row;
+}
+
+/**
+ * Writes the time axis, a vertical grid line and a label in milliseconds for each tick.
+ */
+void timeline_emit_axis(svg_emitter_t *emitter, tree_render_t *render, double height) {
+    double span = (double)(render->end_time - render->start_time);
+    for (int i = 0; i <= TIMELINE_TICKS; i++) {
+        double x = (double)(TIMELINE_WIDTH) * i / TIMELINE_TICKS;
+        svg_emitter_literal(emitter, "<path d=\"M");
+        svg_emitter_number(emitter, x);
+        svg_emitter_literal(emitter, ",");
+        svg_emitter_number(emitter, (double)(TIMELINE_AXIS_HEIGHT) / 2 + 8);
+        svg_emitter_literal(emitter, "V");
+        svg_emitter_number(emitter, height);
+        svg_emitter_literal(emitter, "\" stroke=\"" TIMELINE_GRID_COLOR "\" stroke-width=\"1\" fill=\"none\"/>");
+
+        svg_emitter_literal(emitter, "<text font-family=\"" TEXT_FONT_FAMILY "\" font-size=\"12\" x=\"");
+        svg_emitter_number(emitter, x);
+        svg_emitter_literal(emitter, "\" y=\"");
+        svg_emitter_number(emitter, (double)(TIMELINE_AXIS_HEIGHT) / 2);
+        svg_emitter_literal(emitter, "\" text-anchor=\"middle\" fill=\"" TIMELINE_TEXT_COLOR "\">");
+        svg_emitter_number(emitter, span * i / TIMELINE_TICKS / 1e6);
+        svg_emitter_literal(emitter, " ms</text>");
+    }
+}
+
+/**
+ * Writes the lifetime bar of node on row, with its pid and how long it lived.
+ * Processes that have not exited are drawn up to the end of the snapshot in another color.
+ */
+void timeline_emit_bar(svg_emitter_t *emitter, tree_render_t *render, int node, int row) {
+    int64_t exit_time = render->exit_times[node];
+    double x = timeline_x(render, render->fork_times[node]);
+    double end_x = timeline_x(render, exit_time != 0 ? exit_time : render->end_time);
+    double width = end_x - x > 1 ? end_x - x : 1;
+    double y = timeline_y(row);
+
+    svg_emitter_literal(emitter, "<rect x=\"");
+    svg_emitter_number(emitter, x);
+    svg_emitter_literal(emitter, "\" y=\"");
+    svg_emitter_number(emitter, y);
+    svg_emitter_literal(emitter, "\" width=\"");
+    svg_emitter_number(emitter, width);
+    svg_emitter_literal(emitter, "\" height=\"");
+    svg_emitter_number(emitter, (double)(TIMELINE_BAR_HEIGHT));
+    if (exit_time != 0) {
+        svg_emitter_literal(emitter, "\" fill=\"" CIRCLE_COLOR "\"/>");
+    } else {
+        svg_emitter_literal(emitter, "\" fill=\"" TIMELINE_RUNNING_COLOR "\"/>");
+    }
+
+    svg_emitter_literal(emitter, "<text font-family=\"" TEXT_FONT_FAMILY "\" font-size=\"12\" x=\"");
+    svg_emitter_number(emitter, x + width + 6);
+    svg_emitter_literal(emitter, "\" y=\"");
+    svg_emitter_number(emitter, y + (double)(TIMELINE_BAR_HEIGHT) / 2);
+    svg_emitter_literal(emitter, "\" dominant-baseline=\"middle\" fill=\"" TIMELINE_TEXT_COLOR "\">");
+    svg_emitter_int(emitter, render->index.pids[node]);
+    if (exit_time != 0) {
+        svg_emitter_literal(emitter, " (");
+        svg_emitter_number(emitter, (double)(exit_time - render->fork_times[node]) / 1e6);
+        svg_emitter_literal(emitter, " ms)</text>");
+    } else {
+        svg_emitter_literal(emitter, " (running)</text>");
+    }
+}
+
+/**
+ * Renders the snapshot as a timeline: one row per process in preorder, with a bar from its fork to its exit,
+ * and a line from the bar of its parent at the time it was forked.
+ * Times are only known for processes forked with fork_tree_fork, exits only if they were recorded.
+ */
+int fork_tree_snapshot_render_timeline_svg(fork_tree_snapshot_t *snapshot, FILE *fd) {
+    tree_render_t *render = snapshot->render;
 
-    int end_position = ftell(tmp);
+    // Nothing was forked when the snapshot was taken
+    if (render == NULL) {
+        return 0;
+    }
 
-    if (end_position == -1) {
-        printf("Error getting position\n");
-        fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
+    // The row of each node is its index in the preorder
+    int *rows = malloc(sizeof(int) * render->index.size);
+    if (rows == NULL) {
+        printf("Error allocating memory\n");
         return -1;
     }
 
-    if (fseek(tmp, 0, SEEK_SET) == -1) {
-        printf("Error seeking\n");
-        fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
+    canvas_region_t canvas_region;
+    canvas_region.min_x = -DOCUMENT_MARGIN;
+    canvas_region.min_y = -DOCUMENT_MARGIN;
+    canvas_region.max_x = (double)(TIMELINE_WIDTH) + (double)(TIMELINE_LABEL_WIDTH) + DOCUMENT_MARGIN;
+    canvas_region.max_y = timeline_y(render->number_of_visited) + DOCUMENT_MARGIN;
+
+    svg_emitter_t emitter;
+    if (svg_emitter_create(&emitter, fd, 0) == -1) {
+        printf("Error creating svg emitter\n");
+        free(rows);
         return -1;
     }
 
-    for (int i = 0; i < end_position; i++) {
-        int c = fgetc(tmp);
-        if (c == EOF) {
-            printf("Error reading tmp file\n");
-            fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
-            return -1;
-        }
-        result = fputc(c, fd);
-        if (result == EOF) {
-            printf("Error writing to file\n");
-            fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
-            return -1;
-        }
+    svg_emit_header(&emitter, &canvas_region);
+    timeline_emit_axis(&emitter, render, timeline_y(render->number_of_visited));
+
+    for (int k = 0; k < render->number_of_visited; k++) {
+        rows[render->preorder[k]] = k;
     }
 
-    result = fprintf(fd, "</svg>");
-    if (result < 0) {
-        printf("Error writing svg tag to file\n");
-        fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
-        return -1;
+    for (int k = 1; k < render->number_of_visited; k++) {
+        int node = render->preorder[k];
+        double x = timeline_x(render, render->fork_times[node]);
+        svg_emitter_literal(&emitter, "<path d=\"M");
+        svg_emitter_number(&emitter, x);
+        svg_emitter_literal(&emitter, ",");
+        svg_emitter_number(&emitter, timeline_y(rows[render->parents[node]]) + (double)(TIMELINE_BAR_HEIGHT));
+        svg_emitter_literal(&emitter, "V");
+        svg_emitter_number(&emitter, timeline_y(k));
+        svg_emitter_literal(&emitter, "\" stroke=\"" CONNECTOR_COLOR "\" stroke-width=\"1\" fill=\"none\"/>");
     }
 
-    // document_margin
+    for (int k = 0; k < render->number_of_visited; k++) {
+        timeline_emit_bar(&emitter, render, render->preorder[k], k);
+    }
 
-    canvas_region.min_x -= DOCUMENT_MARGIN;
-    canvas_region.min_y -= DOCUMENT_MARGIN;
-    canvas_region.max_x += DOCUMENT_MARGIN;
-    canvas_region.max_y += DOCUMENT_MARGIN;
+    free(rows);
+
+    svg_emitter_literal(&emitter, "</svg>");
+
+    if (svg_emitter_destroy(&emitter) == -1) {
+        printf("Error writing svg to file\n");
+        return -1;
+    }
 
-    munmap(pages, sizeof(tree_page_t) * shared_tree->number_of_pages);
-    fork_tree_render_cleanup(shared_tree, map, width_map, tmp);
     return 0;
 }
 
+/**
+ * Renders the tree with the given layout and FORK_TREE_SVG_* flags through a snapshot used once.
+ */
+int fork_tree_render_svg(fork_tree_t *tree, FILE *fd, int layout, int flags) {
+    fork_tree_snapshot_t snapshot;
+    if (fork_tree_snapshot_take(tree, &snapshot) == -1) {
+        return -1;
+    }
+
+    int result = fork_tree_snapshot_render_svg(&snapshot, fd, layout, flags);
+    fork_tree_snapshot_free(&snapshot);
+    return result;
+}
+
+int fork_tree_render_centralized_svg(fork_tree_t *tree, FILE *fd) {
+    return fork_tree_render_svg(tree, fd, FORK_TREE_LAYOUT_CENTRALIZED, 0);
+}
+
+int fork_tree_render_dense_svg(fork_tree_t *tree, FILE *fd) {
+    return fork_tree_render_svg(tree, fd, FORK_TREE_LAYOUT_DENSE, 0);
+}
+
+int fork_tree_render_tidy_svg(fork_tree_t *tree, FILE *fd) {
+    return fork_tree_render_svg(tree, fd, FORK_TREE_LAYOUT_TIDY, 0);
+}
+
+int fork_tree_render_timeline_svg(fork_tree_t *tree, FILE *fd) {
+    fork_tree_snapshot_t snapshot;
+    if (fork_tree_snapshot_take(tree, &snapshot) == -1) {
+        return -1;
+    }
+
+    int result = fork_tree_snapshot_render_timeline_svg(&snapshot, fd);
+    fork_tree_snapshot_free(&snapshot);
+    return result;
+}
+
 void fork_tree_destroy(fork_tree_t *tree) {
     shared_tree_t *shared_tree = fork_tree_get_shared_tree(tree);
     if (shared_tree == NULL) {
         return;
     }
 
-    sem_wait(&shared_tree->sem);
-    close(shared_tree->pages_fd);
+    if (EXIT_TREE.shared_tree == shared_tree) {
+        EXIT_TREE.shared_tree = NULL;
+    }
+    child_slots_destroy(tree);
 
-    sem_destroy(&shared_tree->sem);
+    // The semaphore belongs to the program that initialized the tree
+    if (!tree->attached) {
+        sem_wait(&shared_tree->sem);
+        sem_destroy(&shared_tree->sem);
+    }
+    if (tree->pages_fd != tree->shared_tree_fd) {
+        close(tree->pages_fd);
+    }
+
+    munmap(tree->nodes, shared_tree->reserved_size);
     munmap(shared_tree, sizeof(shared_tree_t));
     close(tree->shared_tree_fd);
+
+    tree->shared_tree = NULL;
+    tree->nodes = NULL;
 }
\ No newline at end of file
@@ -1,16 +1,60 @@
 
 #include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 typedef struct ForkTree {
     int shared_tree_fd;
+    // Descriptor the nodes grow through, in this process
+    int pages_fd;
+    // Nonzero if the tree was initialized by another program and attached with fork_tree_attach
+    int attached;
+    // Mapped once by fork_tree_init, the children inherit the mappings across fork()
+    struct SharedTree *shared_tree;
+    struct TreeNode *nodes;
+    // Segment of slots owned by this process, claimed on its first fork
+    pid_t segment_owner;
+    int segment_size;
+    int segment_next;
+    int segment_end;
+    // Process this copy belongs to, and the slot of its own record, -1 for the root
+    pid_t own_pid;
+    int own_slot;
+    // Slots of the records of the children forked by this process, for fork_tree_wait4
+    struct ChildSlots *child_slots;
+    // Taken by the threads of this process around the segment and the child slots, so they can fork at the same time
+    atomic_flag lock;
 } fork_tree_t;
 
+// Backs the nodes with huge pages when they are available
+#define FORK_TREE_HUGE_PAGES 0x1
+// Records the exit time of every process that calls exit() or returns from main, with an atexit handler.
+// Only one tree per program can record its exits this way, others must call fork_tree_exit.
+#define FORK_TREE_RECORD_EXIT 0x2
+// Measures the time the tree adds to each fork, for fork_tree_get_stats.
+// Every measured fork reads the clock twice more and updates counters shared by all the processes.
+#define FORK_TREE_STATS 0x4
+
+typedef struct ForkTreeOptions {
+    // Number of nodes reserved upfront, 0 lets the tree grow from empty
+    int expected_nodes;
+    // Bitwise OR of FORK_TREE_* flags
+    int flags;
+    // File the tree is recorded into instead of memory, NULL for none.
+    // Whatever was recorded stays in the file if the program dies, fork_tree_snapshot_open draws it afterwards.
+    const char *path;
+    // Process the tree starts from, 0 for the calling process.
+    // Tracers record the forks of another process with fork_tree_record_fork.
+    pid_t root_process_id;
+} fork_tree_options_t;
+
 /** 
  * Initialize a fork tree
  * 
@@ -18,9 +62,107 @@ typedef struct ForkTree {
  */
 int fork_tree_init(fork_tree_t *tree);
 
+/**
+ * Initialize a fork tree with room for expected_nodes nodes.
+ * The tree still grows past expected_nodes if needed.
+ *
+ * THIS FUNCTION IS NOT THREAD SAFE
+ */
+int fork_tree_init_with_capacity(fork_tree_t *tree, int expected_nodes);
+
+/**
+ * Initialize a fork tree with the given options, options can be NULL.
+ * With FORK_TREE_HUGE_PAGES the whole capacity is reserved upfront and the tree can't grow past it.
+ * FORK_TREE_HUGE_PAGES is ignored when the tree is recorded into a file.
+ *
+ * THIS FUNCTION IS NOT THREAD SAFE
+ */
+int fork_tree_init_with_options(fork_tree_t *tree, const fork_tree_options_t *options);
+
+/**
+ * Attach to a tree another program records into a file with the path option, to record into the same tree.
+ * Programs executed by the processes of a tree use it to keep recording their forks.
+ * Destroying an attached tree only unmaps it, the program that initialized it still owns it.
+ */
+int fork_tree_attach(fork_tree_t *tree, const char *path);
+
 /* Fork a new process and add it to the tree */
 int fork_tree_fork(fork_tree_t *tree);
 
+/**
+ * Record that parent_pid created child_pid, for processes created by other means than fork_tree_fork:
+ * an interposed fork, posix_spawn, clone, or a process followed by a tracer.
+ * Each process recording with it must be the only one using its copy of the tree.
+ */
+int fork_tree_record_fork(fork_tree_t *tree, pid_t parent_pid, pid_t child_pid);
+
+/**
+ * Same as fork_tree_record_fork, for a fork that happened at fork_time, in nanoseconds of CLOCK_MONOTONIC.
+ * Tracers that record the forks some time after they saw them keep their timeline exact with it.
+ */
+int fork_tree_record_fork_at(fork_tree_t *tree, pid_t parent_pid, pid_t child_pid, int64_t fork_time);
+
+/**
+ * Record a fork made by other means than fork_tree_fork, with the record of the child claimed before forking,
+ * so the child knows its record like with fork_tree_fork and can write its exit time with fork_tree_exit.
+ * fork_tree_prepare_fork returns the claimed slot, or -1 if the tree is full.
+ * fork_tree_finish_fork is then called with that slot in the parent with the pid of the child, or -1 if forking failed,
+ * and in the child with 0.
+ */
+int fork_tree_prepare_fork(fork_tree_t *tree);
+void fork_tree_finish_fork(fork_tree_t *tree, int slot, pid_t child_pid);
+
+/**
+ * Record the exit time of the root or of a process the calling process recorded, with fork_tree_fork, fork_tree_record_fork or fork_tree_finish_fork.
+ * Returns -1 if the process is unknown to this copy of the tree.
+ */
+int fork_tree_record_exit(fork_tree_t *tree, pid_t pid);
+
+/**
+ * Same as fork_tree_record_exit, for an exit that happened at exit_time, in nanoseconds of CLOCK_MONOTONIC.
+ */
+int fork_tree_record_exit_at(fork_tree_t *tree, pid_t pid, int64_t exit_time);
+
+/**
+ * Record the exit time of the calling process, for the timeline.
+ * Call it right before the process exits, or initialize the tree with FORK_TREE_RECORD_EXIT.
+ */
+void fork_tree_exit(fork_tree_t *tree);
+
+/**
+ * Wait for a child like wait4, and record its CPU time, maximum RSS and context switches in the tree.
+ * Only children forked by the calling process with fork_tree_fork are recorded.
+ */
+pid_t fork_tree_wait4(fork_tree_t *tree, pid_t pid, int *status, int options, struct rusage *rusage);
+
+// Number of buckets of the histograms of fork_tree_get_stats
+#define FORK_TREE_STATS_BUCKETS 32
+
+typedef struct ForkTreeHistogram {
+    // buckets[0] counts the samples of 0 ns, buckets[i] those from 2^(i-1) to 2^i - 1 ns,
+    // and the last bucket everything longer
+    long long buckets[FORK_TREE_STATS_BUCKETS];
+    long long count;
+    // Nanoseconds
+    long long total;
+    long long max;
+} fork_tree_histogram_t;
+
+typedef struct ForkTreeStats {
+    // Time fork_tree_fork spends recording each fork, fork() itself excluded
+    fork_tree_histogram_t record;
+    // Time spent waiting for the lock that guards the growth of the nodes
+    fork_tree_histogram_t lock_wait;
+    // Time spent growing the nodes with ftruncate, one sample per growth
+    fork_tree_histogram_t grow;
+} fork_tree_stats_t;
+
+/**
+ * Read the measurements of every process of a tree initialized with FORK_TREE_STATS.
+ * Returns -1 if the tree was initialized without it.
+ */
+int fork_tree_get_stats(fork_tree_t *tree, fork_tree_stats_t *stats);
+
 /**
  * Render the tree to a file in SVG format.
  * This function renders the tree in a centralized way, where the children are evenly distributed.
@@ -34,6 +176,117 @@ int fork_tree_render_centralized_svg(fork_tree_t *tree, FILE *file);
 */
 int fork_tree_render_dense_svg(fork_tree_t *tree, FILE *file);
 
+/**
+ * Render the tree to a file in SVG format.
+ * This function renders the tree as a tidy tree: subtrees are packed as close as their outlines allow,
+ * parents are centered over their children and the layout takes linear time.
+ */
+int fork_tree_render_tidy_svg(fork_tree_t *tree, FILE *file);
+
+/**
+ * Render the tree to a file in SVG format.
+ * This function renders the tree as a timeline, where each process is a bar from its fork to its exit.
+ */
+int fork_tree_render_timeline_svg(fork_tree_t *tree, FILE *file);
+
+// Layouts of fork_tree_render_svg
+#define FORK_TREE_LAYOUT_CENTRALIZED 0
+#define FORK_TREE_LAYOUT_DENSE 1
+#define FORK_TREE_LAYOUT_TIDY 2
+
+// Defines the node, the shadow and the connector once and references them, with the styles in CSS classes.
+// The file is several times smaller, which big trees need to be opened by browsers and viewers.
+#define FORK_TREE_SVG_COMPACT 0x1
+
+// Colors the processes reaped with fork_tree_wait4 from blue to red by one metric, with their resource usage in a tooltip.
+// The metric is their CPU time, their maximum RSS or their context switches.
+#define FORK_TREE_SVG_HEAT_CPU 0x2
+#define FORK_TREE_SVG_HEAT_RSS 0x4
+#define FORK_TREE_SVG_HEAT_SWITCHES 0x8
+#define FORK_TREE_SVG_HEAT_METRICS (FORK_TREE_SVG_HEAT_CPU | FORK_TREE_SVG_HEAT_RSS | FORK_TREE_SVG_HEAT_SWITCHES)
+// Also scales the processes by the metric
+#define FORK_TREE_SVG_HEAT_SIZE 0x10
+
+// Draws each shape of subtree once, so regular trees of millions of processes render in a few nodes.
+// Consecutive siblings with the same subtree are drawn as the first one, labeled with their number and their pids,
+// and a subtree already drawn elsewhere is drawn as its root, ringed and labeled with its number of hidden descendants.
+// Subtrees found more than once are numbered: the drawn one shows its number of copies in the whole tree,
+// and the roots that repeat it show its number.
+#define FORK_TREE_SVG_FOLD 0x20
+
+/**
+ * Render the tree to a file in SVG format with one of the FORK_TREE_LAYOUT_* layouts.
+ * flags is a bitwise OR of FORK_TREE_SVG_* flags.
+ */
+int fork_tree_render_svg(fork_tree_t *tree, FILE *file, int layout, int flags);
+
+typedef struct ForkTreeSnapshot {
+    // Tree built from the recorded forks, NULL if nothing was forked
+    struct TreeRender *render;
+    // Number of processes reachable from the root, the root included
+    int number_of_processes;
+    // Number of generations below the root
+    int depth;
+    // Number of threads big trees are laid out and formatted with, 0 uses every online core
+    int number_of_threads;
+} fork_tree_snapshot_t;
+
+/**
+ * Take a snapshot of the tree, to render it several times with different layouts and flags.
+ * The tree is built once, each render only computes its layout.
+ * Taking a snapshot doesn't block the processes that are still forking, forks in progress may be missing from it.
+ * The snapshot must be freed with fork_tree_snapshot_free.
+ */
+int fork_tree_snapshot_take(fork_tree_t *tree, fork_tree_snapshot_t *snapshot);
+
+/**
+ * Render a snapshot to a file in SVG format with one of the FORK_TREE_LAYOUT_* layouts.
+ * flags is a bitwise OR of FORK_TREE_SVG_* flags.
+ */
+int fork_tree_snapshot_render_svg(fork_tree_snapshot_t *snapshot, FILE *file, int layout, int flags);
+
+/**
+ * Render a snapshot to a file in SVG format as a timeline, with one bar per process from its fork to its exit.
+ * Exit times are only known for processes that called fork_tree_exit or ran the FORK_TREE_RECORD_EXIT handler.
+ */
+int fork_tree_snapshot_render_timeline_svg(fork_tree_snapshot_t *snapshot, FILE *file);
+
+void fork_tree_snapshot_free(fork_tree_snapshot_t *snapshot);
+
+/**
+ * Write the recorded forks to a file in a compact binary trace format.
+ * Only the forks are saved, the trace can be rendered later, on any machine, with fork_tree_snapshot_import.
+ */
+int fork_tree_export(fork_tree_t *tree, FILE *file);
+
+typedef struct ForkTreeRecord {
+    pid_t parent;
+    pid_t child;
+    // CLOCK_MONOTONIC nanoseconds of the fork and the exit of the child, exit_time is 0 if it has not exited
+    int64_t fork_time;
+    int64_t exit_time;
+} fork_tree_record_t;
+
+/**
+ * Call function with every recorded fork, reachable from the root or not, pids reused or not.
+ * Iterating takes no lock, forks recorded meanwhile may or may not be visited.
+ * Stops at the first nonzero value returned by function and returns it, returns 0 once every fork was visited.
+ */
+int fork_tree_for_each_record(fork_tree_t *tree, int (*function)(void *context, const fork_tree_record_t *record), void *context);
+
+/**
+ * Take a snapshot of a trace written by fork_tree_export.
+ * The snapshot must be freed with fork_tree_snapshot_free.
+ */
+int fork_tree_snapshot_import(fork_tree_snapshot_t *snapshot, FILE *file);
+
+/**
+ * Take a snapshot of a tree recorded into a file with the path option, even if the program that recorded it died.
+ * The file is mapped and read in place, it must come from a machine of the same architecture.
+ * The snapshot must be freed with fork_tree_snapshot_free.
+ */
+int fork_tree_snapshot_open(fork_tree_snapshot_t *snapshot, const char *path);
+
 
 // Destroy the fork tree
 void fork_tree_destroy(fork_tree_t *tree);
\ No newline at end of file
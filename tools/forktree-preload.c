@@ -0,0 +1,375 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <sched.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../fork_tree.h"
+
+// Environment of the recorded programs:
+// FORKTREE_OUTPUT is the SVG the root writes when it exits, forktree.svg by default
+// FORKTREE_LAYOUT is centralized, dense, tidy or timeline, dense by default
+// FORKTREE_TRACE is a file the root also exports the trace to, none by default
+// FORKTREE_FILE is the file the tree is recorded into, a temporary file removed by the root by default,
+// unless the root leaves with _exit or _Exit
+// FORKTREE_ROOT is set by the root, so the programs executed by its processes attach to its tree,
+// and FORKTREE_TEMPORARY when it created FORKTREE_FILE itself
+#define PRELOAD_DEFAULT_OUTPUT "forktree.svg"
+#define PRELOAD_TEMPORARY_FILE "/tmp/forktree-XXXXXX"
+
+typedef pid_t (*fork_function_t)(void);
+typedef int (*posix_spawn_function_t)(pid_t *, const char *, const posix_spawn_file_actions_t *, const posix_spawnattr_t *, char *const[], char *const[]);
+typedef int (*clone_function_t)(int (*)(void *), void *, int, void *, ...);
+typedef void (*exit_function_t)(int);
+typedef pid_t (*wait4_function_t)(pid_t, int *, int, struct rusage *);
+typedef int (*waitid_function_t)(idtype_t, id_t, siginfo_t *, int);
+
+fork_tree_t PRELOAD_TREE;
+// Nonzero once the tree is initialized or attached, forks before that are not recorded
+int PRELOAD_READY = 0;
+// Nonzero in the process that initialized the tree
+int PRELOAD_ROOT = 0;
+// Temporary file the tree is recorded into, removed by the root, NULL if given by the user
+char *PRELOAD_TEMPORARY_PATH = NULL;
+
+fork_function_t REAL_FORK = NULL;
+posix_spawn_function_t REAL_POSIX_SPAWN = NULL;
+posix_spawn_function_t REAL_POSIX_SPAWNP = NULL;
+clone_function_t REAL_CLONE = NULL;
+exit_function_t REAL_EXIT = NULL;
+exit_function_t REAL_EXIT_C99 = NULL;
+wait4_function_t REAL_WAIT4 = NULL;
+waitid_function_t REAL_WAITID = NULL;
+
+void preload_resolve(void) {
+    if (REAL_FORK == NULL) {
+        REAL_FORK = (fork_function_t)dlsym(RTLD_NEXT, "fork");
+        REAL_POSIX_SPAWN = (posix_spawn_function_t)dlsym(RTLD_NEXT, "posix_spawn");
+        REAL_POSIX_SPAWNP = (posix_spawn_function_t)dlsym(RTLD_NEXT, "posix_spawnp");
+        REAL_CLONE = (clone_function_t)dlsym(RTLD_NEXT, "clone");
+        REAL_EXIT = (exit_function_t)dlsym(RTLD_NEXT, "_exit");
+        REAL_EXIT_C99 = (exit_function_t)dlsym(RTLD_NEXT, "_Exit");
+        REAL_WAIT4 = (wait4_function_t)dlsym(RTLD_NEXT, "wait4");
+        REAL_WAITID = (waitid_function_t)dlsym(RTLD_NEXT, "waitid");
+    }
+}
+
+/**
+ * Records a child created by the calling process, for children that never run the code of the hooks.
+ * The pid of the parent is kept up to date by the hooks, so it isn't asked for twice.
+ */
+void preload_record(pid_t child_pid) {
+    if (!PRELOAD_READY || child_pid <= 0) {
+        return;
+    }
+
+    fork_tree_record_fork(&PRELOAD_TREE, PRELOAD_TREE.own_pid, child_pid);
+}
+
+/**
+ * Claims the record of a child before forking it, so the child knows where to write its exit time.
+ * This is the only work added to each fork: claiming a slot from the segment of the process, and filling it afterwards.
+ */
+int preload_prepare(void) {
+    if (!PRELOAD_READY) {
+        return -1;
+    }
+
+    return fork_tree_prepare_fork(&PRELOAD_TREE);
+}
+
+/**
+ * The child keeps the slot claimed by its parent as its own record and drops the children of its parent.
+ */
+void preload_child(int slot) {
+    PRELOAD_ROOT = 0;
+    if (PRELOAD_READY) {
+        fork_tree_finish_fork(&PRELOAD_TREE, slot, 0);
+    }
+}
+
+/**
+ * Publishes the record claimed by preload_prepare once the child is forked, pid is -1 if forking failed.
+ */
+void preload_finish(int slot, pid_t pid) {
+    if (!PRELOAD_READY) {
+        return;
+    }
+
+    fork_tree_finish_fork(&PRELOAD_TREE, slot, pid);
+}
+
+pid_t fork(void) {
+    preload_resolve();
+    int slot = preload_prepare();
+    pid_t pid = REAL_FORK();
+    if (pid == 0) {
+        preload_child(slot);
+    } else {
+        preload_finish(slot, pid);
+    }
+    return pid;
+}
+
+// The child of vfork borrows the memory of its parent, where it can't record anything, so it is forked instead.
+// Children of vfork may only exec or _exit, which they can do as well after a fork.
+pid_t vfork(void) {
+    return fork();
+}
+
+int posix_spawn(pid_t *pid, const char *path, const posix_spawn_file_actions_t *file_actions, const posix_spawnattr_t *attributes, char *const argv[], char *const envp[]) {
+    preload_resolve();
+    pid_t child_pid;
+    int result = REAL_POSIX_SPAWN(&child_pid, path, file_actions, attributes, argv, envp);
+    if (result == 0) {
+        preload_record(child_pid);
+        if (pid != NULL) {
+            *pid = child_pid;
+        }
+    }
+    return result;
+}
+
+int posix_spawnp(pid_t *pid, const char *file, const posix_spawn_file_actions_t *file_actions, const posix_spawnattr_t *attributes, char *const argv[], char *const envp[]) {
+    preload_resolve();
+    pid_t child_pid;
+    int result = REAL_POSIX_SPAWNP(&child_pid, file, file_actions, attributes, argv, envp);
+    if (result == 0) {
+        preload_record(child_pid);
+        if (pid != NULL) {
+            *pid = child_pid;
+        }
+    }
+    return result;
+}
+
+typedef struct PreloadClone {
+    int (*fn)(void *);
+    void *arg;
+    // Record claimed for the child
+    int slot;
+} preload_clone_t;
+
+// Runs first in children with their own memory, which may fork in turn
+int preload_clone_child(void *argument) {
+    preload_clone_t *clone_argument = argument;
+    preload_child(clone_argument->slot);
+    return clone_argument->fn(clone_argument->arg);
+}
+
+// Threads are not processes of the tree, only clones without CLONE_THREAD are recorded.
+// Children sharing the memory of their parent, with CLONE_VM, never touch the tree.
+int clone(int (*fn)(void *), void *stack, int flags, void *arg, ...) {
+    preload_resolve();
+
+    va_list arguments;
+    va_start(arguments, arg);
+    pid_t *parent_tid = va_arg(arguments, pid_t *);
+    void *tls = va_arg(arguments, void *);
+    pid_t *child_tid = va_arg(arguments, pid_t *);
+    va_end(arguments);
+
+    if (flags & (CLONE_VM | CLONE_THREAD)) {
+        int pid = REAL_CLONE(fn, stack, flags, arg, parent_tid, tls, child_tid);
+        if (pid > 0 && !(flags & CLONE_THREAD)) {
+            preload_record(pid);
+        }
+        return pid;
+    }
+
+    // The child gets a copy of the memory of its parent, this argument included
+    preload_clone_t clone_argument = {fn, arg, preload_prepare()};
+    int pid = REAL_CLONE(preload_clone_child, stack, flags, &clone_argument, parent_tid, tls, child_tid);
+    preload_finish(clone_argument.slot, pid);
+    return pid;
+}
+
+/**
+ * Children that executed another program lost their record, their parent records their exit when it reaps them.
+ * Children that recorded their own exit keep it.
+ */
+void preload_reaped(pid_t pid) {
+    if (!PRELOAD_READY) {
+        return;
+    }
+
+    fork_tree_record_exit(&PRELOAD_TREE, pid);
+}
+
+// wait, waitpid and wait3 are wait4 with fewer arguments, as in glibc
+pid_t wait4(pid_t pid, int *status, int options, struct rusage *rusage) {
+    preload_resolve();
+    int child_status;
+    pid_t reaped = REAL_WAIT4(pid, &child_status, options, rusage);
+    if (reaped > 0) {
+        if (WIFEXITED(child_status) || WIFSIGNALED(child_status)) {
+            preload_reaped(reaped);
+        }
+        if (status != NULL) {
+            *status = child_status;
+        }
+    }
+    return reaped;
+}
+
+pid_t wait(int *status) {
+    return wait4(-1, status, 0, NULL);
+}
+
+pid_t waitpid(pid_t pid, int *status, int options) {
+    return wait4(pid, status, options, NULL);
+}
+
+pid_t wait3(int *status, int options, struct rusage *rusage) {
+    return wait4(-1, status, options, rusage);
+}
+
+int waitid(idtype_t idtype, id_t id, siginfo_t *info, int options) {
+    preload_resolve();
+    int result = REAL_WAITID(idtype, id, info, options);
+    if (result == 0 && info != NULL && info->si_pid > 0 && (info->si_code == CLD_EXITED || info->si_code == CLD_KILLED || info->si_code == CLD_DUMPED)) {
+        preload_reaped(info->si_pid);
+    }
+    return result;
+}
+
+__attribute__((constructor)) void preload_init(void) {
+    preload_resolve();
+
+    // Programs executed by a process of the tree keep recording into it
+    const char *path = getenv("FORKTREE_FILE");
+    const char *root_process_id = getenv("FORKTREE_ROOT");
+    if (root_process_id != NULL) {
+        if (path != NULL && fork_tree_attach(&PRELOAD_TREE, path) == 0) {
+            // The root itself may have executed another program, which writes the tree instead
+            if (atoi(root_process_id) == getpid()) {
+                PRELOAD_ROOT = 1;
+                if (getenv("FORKTREE_TEMPORARY") != NULL) {
+                    PRELOAD_TEMPORARY_PATH = strdup(path);
+                }
+            }
+            PRELOAD_READY = 1;
+        }
+        return;
+    }
+
+    if (path == NULL) {
+        PRELOAD_TEMPORARY_PATH = strdup(PRELOAD_TEMPORARY_FILE);
+        int fd = PRELOAD_TEMPORARY_PATH == NULL ? -1 : mkstemp(PRELOAD_TEMPORARY_PATH);
+        if (fd == -1) {
+            free(PRELOAD_TEMPORARY_PATH);
+            PRELOAD_TEMPORARY_PATH = NULL;
+            return;
+        }
+        close(fd);
+        path = PRELOAD_TEMPORARY_PATH;
+    }
+
+    fork_tree_options_t options = {.path = path};
+    if (fork_tree_init_with_options(&PRELOAD_TREE, &options) == -1) {
+        return;
+    }
+
+    char root[16];
+    snprintf(root, sizeof(root), "%d", (int)getpid());
+    setenv("FORKTREE_FILE", path, 1);
+    setenv("FORKTREE_ROOT", root, 1);
+    if (PRELOAD_TEMPORARY_PATH != NULL) {
+        setenv("FORKTREE_TEMPORARY", "1", 1);
+    }
+    PRELOAD_ROOT = 1;
+    PRELOAD_READY = 1;
+}
+
+/**
+ * Writes the tree from the root while its descendants may still run.
+ */
+void preload_dump(void) {
+    PRELOAD_READY = 0;
+
+    const char *trace_path = getenv("FORKTREE_TRACE");
+    if (trace_path != NULL) {
+        FILE *trace = fopen(trace_path, "wb");
+        if (trace == NULL || fork_tree_export(&PRELOAD_TREE, trace) == -1) {
+            fprintf(stderr, "forktree: error writing %s\n", trace_path);
+        }
+        if (trace != NULL) {
+            fclose(trace);
+        }
+    }
+
+    const char *layout_name = getenv("FORKTREE_LAYOUT");
+    int layout = FORK_TREE_LAYOUT_DENSE;
+    int timeline = 0;
+    if (layout_name != NULL && strcmp(layout_name, "centralized") == 0) {
+        layout = FORK_TREE_LAYOUT_CENTRALIZED;
+    } else if (layout_name != NULL && strcmp(layout_name, "tidy") == 0) {
+        layout = FORK_TREE_LAYOUT_TIDY;
+    } else if (layout_name != NULL && strcmp(layout_name, "timeline") == 0) {
+        timeline = 1;
+    }
+
+    const char *output_path = getenv("FORKTREE_OUTPUT");
+    if (output_path == NULL) {
+        output_path = PRELOAD_DEFAULT_OUTPUT;
+    }
+
+    FILE *output = fopen(output_path, "w");
+    int result = -1;
+    if (output != NULL) {
+        result = timeline ? fork_tree_render_timeline_svg(&PRELOAD_TREE, output) : fork_tree_render_svg(&PRELOAD_TREE, output, layout, FORK_TREE_SVG_COMPACT);
+        if (fclose(output) == EOF) {
+            result = -1;
+        }
+    }
+    if (result == -1) {
+        fprintf(stderr, "forktree: error writing %s\n", output_path);
+    }
+
+    // The descendants still running keep their mapping of the file, removing it doesn't stop them
+    if (PRELOAD_TEMPORARY_PATH != NULL) {
+        unlink(PRELOAD_TEMPORARY_PATH);
+    }
+}
+
+/**
+ * Records the exit of the calling process, and the root writes the tree.
+ * Runs when a process exits or returns from main.
+ */
+__attribute__((destructor)) void preload_exit(void) {
+    if (!PRELOAD_READY) {
+        return;
+    }
+
+    fork_tree_exit(&PRELOAD_TREE);
+    if (PRELOAD_ROOT && PRELOAD_TREE.own_pid == getpid()) {
+        preload_dump();
+    }
+}
+
+// _exit and _Exit may be called from signal handlers, as shells do, so they only record the exit time.
+// A root leaving with them writes no SVG, its tree stays in FORKTREE_FILE for forktree-render.
+void preload_exit_now(void) {
+    if (PRELOAD_READY) {
+        fork_tree_exit(&PRELOAD_TREE);
+    }
+}
+
+void _exit(int status) {
+    preload_resolve();
+    preload_exit_now();
+    REAL_EXIT(status);
+    __builtin_unreachable();
+}
+
+void _Exit(int status) {
+    preload_resolve();
+    preload_exit_now();
+    REAL_EXIT_C99(status);
+    __builtin_unreachable();
+}
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../fork_tree.h"
+
+void usage(const char *name) {
+    printf("Usage: %s [-l centralized|dense|tidy|timeline] [-c] [-m cpu|rss|switches] [-s] [-f] [-j threads] trace output.svg\n", name);
+    printf("  trace is a file written by fork_tree_export or a tree recorded into a file\n");
+    printf("  -l  layout of the tree, dense by default\n");
+    printf("  -c  writes a compact SVG\n");
+    printf("  -m  colors the reaped processes by their CPU time, maximum RSS or context switches\n");
+    printf("  -s  also scales the reaped processes by that metric\n");
+    printf("  -f  draws each shape of subtree once\n");
+    printf("  -j  number of threads, every online core by default\n");
+}
+
+// Renders a trace written by fork_tree_export, or a tree recorded into a file with the path option
+int main(int argc, char* argv[]) {
+    int layout = FORK_TREE_LAYOUT_DENSE;
+    int timeline = 0;
+    int flags = 0;
+    int number_of_threads = 0;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-c") == 0) {
+            flags |= FORK_TREE_SVG_COMPACT;
+        } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "centralized") == 0) {
+                layout = FORK_TREE_LAYOUT_CENTRALIZED;
+            } else if (strcmp(argv[i], "dense") == 0) {
+                layout = FORK_TREE_LAYOUT_DENSE;
+            } else if (strcmp(argv[i], "tidy") == 0) {
+                layout = FORK_TREE_LAYOUT_TIDY;
+            } else if (strcmp(argv[i], "timeline") == 0) {
+                timeline = 1;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "cpu") == 0) {
+                flags |= FORK_TREE_SVG_HEAT_CPU;
+            } else if (strcmp(argv[i], "rss") == 0) {
+                flags |= FORK_TREE_SVG_HEAT_RSS;
+            } else if (strcmp(argv[i], "switches") == 0) {
+                flags |= FORK_TREE_SVG_HEAT_SWITCHES;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-s") == 0) {
+            flags |= FORK_TREE_SVG_HEAT_SIZE;
+        } else if (strcmp(argv[i], "-f") == 0) {
+            flags |= FORK_TREE_SVG_FOLD;
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            number_of_threads = atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - i != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE* trace = fopen(argv[i], "rb");
+    if (trace == NULL) {
+        printf("Error opening %s\n", argv[i]);
+        return 1;
+    }
+
+    // Trees recorded into a file start with their own magic instead of the one of the traces
+    char magic[4] = {0};
+    size_t magic_length = fread(magic, 1, sizeof(magic), trace);
+    rewind(trace);
+
+    fork_tree_snapshot_t snapshot;
+    int result;
+    if (magic_length == sizeof(magic) && memcmp(magic, "FTST", sizeof(magic)) == 0) {
+        result = fork_tree_snapshot_open(&snapshot, argv[i]);
+    } else {
+        result = fork_tree_snapshot_import(&snapshot, trace);
+    }
+    fclose(trace);
+    if (result == -1) {
+        return 1;
+    }
+    snapshot.number_of_threads = number_of_threads;
+
+    FILE* file = fopen(argv[i + 1], "w");
+    if (file == NULL) {
+        printf("Error opening %s\n", argv[i + 1]);
+        fork_tree_snapshot_free(&snapshot);
+        return 1;
+    }
+
+    if (timeline) {
+        result = fork_tree_snapshot_render_timeline_svg(&snapshot, file);
+    } else {
+        result = fork_tree_snapshot_render_svg(&snapshot, file, layout, flags);
+    }
+    fork_tree_snapshot_free(&snapshot);
+    if (fclose(file) == EOF || result == -1) {
+        printf("Error while rendering tree\n");
+        return 1;
+    }
+
+    return 0;
+}
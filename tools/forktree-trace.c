@@ -0,0 +1,493 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../fork_tree.h"
+
+// Maximum number of events drained with WNOHANG before the forks they carry are recorded
+#define TRACE_BATCH_SIZE 256
+
+#define TRACE_OPTIONS (PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC)
+
+typedef struct Tracee {
+    pid_t tid;
+    // Process the thread belongs to, tid itself for the main thread of a process
+    pid_t tgid;
+    // Zero until the first stop of a new tracee, which is not a group stop
+    int started;
+    // Zero until the event of the fork that created the tracee is read, the tracees the tracer starts from are known
+    int forked;
+    // Times a tracee stopped first and exited before the event of its fork was read, they are recorded with that fork
+    int64_t fork_time;
+    int64_t exit_time;
+} tracee_t;
+
+typedef struct TraceeTable {
+    // Open addressing table of the traced threads, tid 0 marks an empty entry
+    tracee_t *entries;
+    int table_bits;
+    int size;
+} tracee_table_t;
+
+typedef struct PendingFork {
+    pid_t parent;
+    pid_t child;
+    // Time the event of the fork was read, on the clock of the tree
+    int64_t fork_time;
+} pending_fork_t;
+
+// Set by SIGINT and SIGTERM when tracing a process given with -p, to detach from it
+volatile sig_atomic_t INTERRUPTED = 0;
+
+void trace_interrupt(int signal_number) {
+    (void)signal_number;
+    INTERRUPTED = 1;
+}
+
+uint32_t tracee_table_hash(tracee_table_t *table, pid_t tid) {
+    return ((uint32_t)tid * 2654435769u) >> (32 - table->table_bits);
+}
+
+/**
+ * Returns the entry of tid, or the empty entry where it belongs.
+ */
+tracee_t *tracee_table_find(tracee_table_t *table, pid_t tid) {
+    uint32_t mask = (1u << table->table_bits) - 1;
+    uint32_t entry = tracee_table_hash(table, tid);
+    while (table->entries[entry].tid != 0 && table->entries[entry].tid != tid) {
+        entry = (entry + 1) & mask;
+    }
+    return &table->entries[entry];
+}
+
+/**
+ * Adds tid if it is new, the table doubles when it is half full.
+ * Returns -1 if tid was already traced or on error.
+ */
+int tracee_table_add(tracee_table_t *table, pid_t tid, pid_t tgid, int started, int forked) {
+    if (tracee_table_find(table, tid)->tid == tid) {
+        return -1;
+    }
+
+    if (table->size * 2 >= (1 << table->table_bits)) {
+        tracee_table_t grown = {calloc((size_t)1 << (table->table_bits + 1), sizeof(tracee_t)), table->table_bits + 1, 0};
+        if (grown.entries == NULL) {
+            printf("Error allocating memory\n");
+            return -1;
+        }
+        for (int i = 0; i < (1 << table->table_bits); i++) {
+            if (table->entries[i].tid != 0) {
+                *tracee_table_find(&grown, table->entries[i].tid) = table->entries[i];
+                grown.size++;
+            }
+        }
+        free(table->entries);
+        *table = grown;
+    }
+
+    tracee_t *tracee = tracee_table_find(table, tid);
+    tracee->tid = tid;
+    tracee->tgid = tgid;
+    tracee->started = started;
+    tracee->forked = forked;
+    tracee->fork_time = 0;
+    tracee->exit_time = 0;
+    table->size++;
+    return 0;
+}
+
+/**
+ * Removes tid, reinserting the entries after it so probes never stop early.
+ */
+void tracee_table_remove(tracee_table_t *table, pid_t tid) {
+    tracee_t *tracee = tracee_table_find(table, tid);
+    if (tracee->tid != tid) {
+        return;
+    }
+
+    uint32_t mask = (1u << table->table_bits) - 1;
+    uint32_t entry = (uint32_t)(tracee - table->entries);
+    table->entries[entry].tid = 0;
+    table->size--;
+
+    for (entry = (entry + 1) & mask; table->entries[entry].tid != 0; entry = (entry + 1) & mask) {
+        tracee_t moved = table->entries[entry];
+        table->entries[entry].tid = 0;
+        *tracee_table_find(table, moved.tid) = moved;
+    }
+}
+
+/**
+ * Reads the process a new thread belongs to, the event of clone doesn't tell threads from processes.
+ */
+pid_t trace_read_tgid(pid_t tid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)tid);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return tid;
+    }
+
+    char line[256];
+    pid_t tgid = tid;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strncmp(line, "Tgid:", 5) == 0) {
+            tgid = (pid_t)atoi(line + 5);
+            break;
+        }
+    }
+    fclose(file);
+    return tgid;
+}
+
+/**
+ * Seizes every thread of process_id, only the forks made after that are recorded.
+ */
+int trace_attach(tracee_table_t *tracees, pid_t process_id) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task", (int)process_id);
+    DIR *tasks = opendir(path);
+    if (tasks == NULL) {
+        printf("Error process %d not found\n", (int)process_id);
+        return -1;
+    }
+
+    struct dirent *task;
+    int attached = 0;
+    while ((task = readdir(tasks)) != NULL) {
+        pid_t tid = (pid_t)atoi(task->d_name);
+        if (tid <= 0) {
+            continue;
+        }
+        if (ptrace(PTRACE_SEIZE, tid, NULL, (void *)(long)TRACE_OPTIONS) == -1) {
+            printf("Error attaching to %d: %s\n", (int)tid, strerror(errno));
+            continue;
+        }
+        tracee_table_add(tracees, tid, process_id, 1, 1);
+        attached++;
+    }
+    closedir(tasks);
+    return attached > 0 ? 0 : -1;
+}
+
+/**
+ * Starts the command stopped, seizes it, and lets it execute.
+ */
+pid_t trace_start(tracee_table_t *tracees, char *argv[]) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        printf("Error forking\n");
+        return -1;
+    }
+
+    if (pid == 0) {
+        raise(SIGSTOP);
+        execvp(argv[0], argv);
+        fprintf(stderr, "Error executing %s: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+
+    int status;
+    if (waitpid(pid, &status, WSTOPPED) == -1 || !WIFSTOPPED(status) ||
+        ptrace(PTRACE_SEIZE, pid, NULL, (void *)(long)(TRACE_OPTIONS | PTRACE_O_EXITKILL)) == -1) {
+        printf("Error tracing %s\n", argv[0]);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    tracee_table_add(tracees, pid, pid, 1, 1);
+    kill(pid, SIGCONT);
+    return pid;
+}
+
+int64_t trace_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Records the queued forks with the time their events were read.
+ */
+void trace_record_pending(fork_tree_t *tree, pending_fork_t *pending, int *number_of_pending) {
+    for (int i = 0; i < *number_of_pending; i++) {
+        fork_tree_record_fork_at(tree, pending[i].parent, pending[i].child, pending[i].fork_time);
+    }
+    *number_of_pending = 0;
+}
+
+/**
+ * Handles one stop or exit of a tracee, resuming it right away.
+ * Forks are only queued, they are recorded once the batch is drained, or before an exit since it may be one of them.
+ */
+void trace_handle(fork_tree_t *tree, tracee_table_t *tracees, pending_fork_t *pending, int *number_of_pending, pid_t tid, int status) {
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        tracee_t *exited = tracee_table_find(tracees, tid);
+        // A child may exit before the event of its parent is read, it is kept until then
+        if (exited->tid == tid && !exited->forked) {
+            exited->exit_time = trace_now();
+            return;
+        }
+        if (exited->tid == tid && exited->tgid == tid) {
+            trace_record_pending(tree, pending, number_of_pending);
+            fork_tree_record_exit(tree, tid);
+        }
+        tracee_table_remove(tracees, tid);
+        return;
+    }
+
+    if (!WIFSTOPPED(status)) {
+        return;
+    }
+
+    int event = status >> 16;
+    int signal_number = WSTOPSIG(status);
+
+    // The first stop of a thread or process created by a tracee, it may come before the event of its parent
+    tracee_t *tracee = tracee_table_find(tracees, tid);
+    if (tracee->tid != tid || !tracee->started) {
+        if (tracee->tid != tid) {
+            tracee_table_add(tracees, tid, tid, 1, 0);
+            tracee_table_find(tracees, tid)->fork_time = trace_now();
+        } else {
+            tracee->started = 1;
+        }
+        ptrace(PTRACE_CONT, tid, NULL, NULL);
+        return;
+    }
+
+    if (event == PTRACE_EVENT_FORK || event == PTRACE_EVENT_VFORK || event == PTRACE_EVENT_CLONE) {
+        int64_t fork_time = trace_now();
+        unsigned long message = 0;
+        ptrace(PTRACE_GETEVENTMSG, tid, NULL, &message);
+        ptrace(PTRACE_CONT, tid, NULL, NULL);
+
+        pid_t child = (pid_t)message;
+        pid_t parent = tracee->tgid;
+        pid_t tgid = event == PTRACE_EVENT_CLONE ? trace_read_tgid(child) : child;
+
+        tracee_t *child_tracee = tracee_table_find(tracees, child);
+        int64_t exit_time = 0;
+        if (child_tracee->tid == child) {
+            exit_time = child_tracee->exit_time;
+            child_tracee->tgid = tgid;
+            if (!child_tracee->forked && child_tracee->fork_time != 0) {
+                fork_time = child_tracee->fork_time;
+            }
+            child_tracee->forked = 1;
+        } else {
+            tracee_table_add(tracees, child, tgid, 0, 1);
+        }
+
+        // Threads are not processes of the tree
+        if (tgid == child) {
+            pending[*number_of_pending].parent = parent;
+            pending[*number_of_pending].child = child;
+            pending[*number_of_pending].fork_time = fork_time;
+            (*number_of_pending)++;
+        }
+
+        // The child already exited, its fork is recorded right away so its exit can be
+        if (exit_time != 0) {
+            if (tgid == child) {
+                trace_record_pending(tree, pending, number_of_pending);
+                fork_tree_record_exit_at(tree, child, exit_time);
+            }
+            tracee_table_remove(tracees, child);
+        }
+        return;
+    }
+
+    if (event == PTRACE_EVENT_STOP) {
+        // Group stops keep the tracee stopped until it is continued by a signal, like without a tracer
+        if (signal_number == SIGSTOP || signal_number == SIGTSTP || signal_number == SIGTTIN || signal_number == SIGTTOU) {
+            ptrace(PTRACE_LISTEN, tid, NULL, NULL);
+        } else {
+            ptrace(PTRACE_CONT, tid, NULL, NULL);
+        }
+        return;
+    }
+
+    if (event != 0) {
+        ptrace(PTRACE_CONT, tid, NULL, NULL);
+        return;
+    }
+
+    // Signals are delivered as if there was no tracer
+    ptrace(PTRACE_CONT, tid, NULL, (void *)(long)signal_number);
+}
+
+/**
+ * Stops and detaches every tracee, they keep running untraced.
+ */
+void trace_detach(tracee_table_t *tracees) {
+    for (int i = 0; i < (1 << tracees->table_bits); i++) {
+        pid_t tid = tracees->entries[i].tid;
+        if (tid == 0 || ptrace(PTRACE_INTERRUPT, tid, NULL, NULL) == -1) {
+            continue;
+        }
+
+        int status;
+        while (waitpid(tid, &status, __WALL) == tid && WIFSTOPPED(status) && (status >> 16) != PTRACE_EVENT_STOP) {
+            // Signals and events that were pending before the interruption
+            int signal_number = (status >> 16) == 0 ? WSTOPSIG(status) : 0;
+            ptrace(PTRACE_CONT, tid, NULL, (void *)(long)signal_number);
+            ptrace(PTRACE_INTERRUPT, tid, NULL, NULL);
+        }
+        ptrace(PTRACE_DETACH, tid, NULL, NULL);
+    }
+}
+
+/**
+ * Follows the tracees until they all exit, or until interrupted.
+ * Waits for one event, drains the others already there without blocking, then records their forks.
+ */
+int trace_run(fork_tree_t *tree, tracee_table_t *tracees) {
+    pending_fork_t pending[TRACE_BATCH_SIZE];
+
+    while (!INTERRUPTED) {
+        int status;
+        pid_t tid = waitpid(-1, &status, __WALL);
+        if (tid == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == ECHILD ? 0 : -1;
+        }
+
+        int number_of_pending = 0;
+        int number_of_events = 0;
+        do {
+            trace_handle(tree, tracees, pending, &number_of_pending, tid, status);
+            number_of_events++;
+        } while (number_of_events < TRACE_BATCH_SIZE && (tid = waitpid(-1, &status, __WALL | WNOHANG)) > 0);
+
+        trace_record_pending(tree, pending, &number_of_pending);
+    }
+
+    trace_detach(tracees);
+    return 0;
+}
+
+void usage(const char *name) {
+    printf("Usage: %s [-l centralized|dense|tidy|timeline] [-c] [-o output.svg] [-t trace] (-p pid | command [arguments...])\n", name);
+    printf("  -l  layout of the tree, dense by default\n");
+    printf("  -c  writes a compact SVG\n");
+    printf("  -o  file the tree is drawn to, forktree.svg by default\n");
+    printf("  -t  file the trace is also exported to, for forktree-render\n");
+    printf("  -p  follows a running process until it exits or until interrupted\n");
+}
+
+// Records the fork tree of an unmodified program with ptrace, and draws it
+int main(int argc, char *argv[]) {
+    int layout = FORK_TREE_LAYOUT_DENSE;
+    int timeline = 0;
+    int flags = 0;
+    const char *output_path = "forktree.svg";
+    const char *trace_path = NULL;
+    pid_t process_id = 0;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-c") == 0) {
+            flags |= FORK_TREE_SVG_COMPACT;
+        } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "centralized") == 0) {
+                layout = FORK_TREE_LAYOUT_CENTRALIZED;
+            } else if (strcmp(argv[i], "dense") == 0) {
+                layout = FORK_TREE_LAYOUT_DENSE;
+            } else if (strcmp(argv[i], "tidy") == 0) {
+                layout = FORK_TREE_LAYOUT_TIDY;
+            } else if (strcmp(argv[i], "timeline") == 0) {
+                timeline = 1;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output_path = argv[++i];
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            process_id = (pid_t)atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ((process_id > 0) == (i < argc)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    tracee_table_t tracees = {calloc(64, sizeof(tracee_t)), 6, 0};
+    if (tracees.entries == NULL) {
+        printf("Error allocating memory\n");
+        return 1;
+    }
+
+    if (process_id > 0) {
+        if (trace_attach(&tracees, process_id) == -1) {
+            return 1;
+        }
+        // Interrupting detaches from the process instead of killing the tracer with its tracees stopped
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = trace_interrupt;
+        sigaction(SIGINT, &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
+    } else {
+        process_id = trace_start(&tracees, argv + i);
+        if (process_id == -1) {
+            return 1;
+        }
+        // The command gets the interruptions of the terminal itself and exits, which ends the trace.
+        // They are ignored only once it is started, an ignored signal would stay ignored across its exec.
+        signal(SIGINT, SIG_IGN);
+    }
+
+    fork_tree_t tree;
+    fork_tree_options_t options = {.root_process_id = process_id};
+    if (fork_tree_init_with_options(&tree, &options) == -1) {
+        printf("Error initializing tree\n");
+        return 1;
+    }
+
+    int result = trace_run(&tree, &tracees);
+    free(tracees.entries);
+
+    if (trace_path != NULL) {
+        FILE *trace = fopen(trace_path, "wb");
+        if (trace == NULL || fork_tree_export(&tree, trace) == -1 || fclose(trace) == EOF) {
+            printf("Error writing %s\n", trace_path);
+            result = -1;
+        }
+    }
+
+    FILE *file = fopen(output_path, "w");
+    if (file == NULL) {
+        printf("Error opening %s\n", output_path);
+        fork_tree_destroy(&tree);
+        return 1;
+    }
+
+    int render_result = timeline ? fork_tree_render_timeline_svg(&tree, file) : fork_tree_render_svg(&tree, file, layout, flags);
+    fork_tree_destroy(&tree);
+    if (fclose(file) == EOF || render_result == -1) {
+        printf("Error while rendering tree\n");
+        return 1;
+    }
+
+    return result == -1 ? 1 : 0;
+}